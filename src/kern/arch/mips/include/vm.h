@@ -113,17 +113,21 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown carries a batch of up to 16 frames whose translations
+ * are dropped, whatever their virtual address and ASID: a frame shared
+ * copy-on-write is mapped at several of them. Up to 16 batches can be
+ * queued on a CPU; when the queue is full, batches are merged, and
+ * past 16 frames the merged batch just flushes the whole TLB.
  */
 
+#define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_ALL (TLBSHOOTDOWN_MAX + 1)	/* ts_npages: flush the TLB */
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	unsigned ts_nbatches;			/* Batches merged in this one */
+	unsigned ts_npages;			/* Frames, or TLBSHOOTDOWN_ALL */
+	paddr_t ts_paddrs[TLBSHOOTDOWN_MAX];	/* Frames to drop */
 };
 
-#define TLBSHOOTDOWN_MAX 16
-
 
 #endif /* _MIPS_VM_H_ */
@@ -164,6 +164,23 @@ syscall(struct trapframe *tf)
 	        err = sys_fork(tf,&retval);
                 break;
 
+	    case SYS_sbrk:
+	        err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+                break;
+
+	    case SYS_mmap:
+	        err = sys_mmap(tf, &retval);
+                break;
+
+	    case SYS_munmap:
+	        err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+                break;
+
+	    case SYS_msync:
+	        err = sys_msync((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2);
+                break;
+
 #endif
 
 	    default:
@@ -133,6 +133,14 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_merge(struct tlbshootdown *into, const struct tlbshootdown *ts)
+{
+	(void)into;
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
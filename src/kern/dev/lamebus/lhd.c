@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,13 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Reads served in a row before a waiting write gets the disk */
+#define LHD_READBURST   8
+
+/* Disks whose statistics are printed by lhd_printstats */
+#define LHD_MAXUNITS    8
+static struct lhd_softc *lhd_units[LHD_MAXUNITS];
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +104,168 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Kernel address of the next sector of a request.
+ */
+static
+char *
+lhd_sectdata(struct lhd_request *lr)
+{
+	return (char *)lr->lr_iov[lr->lr_iovdone].iov_kbase +
+		lr->lr_bufdone*LHD_SECTSIZE;
+}
+
+/*
+ * Start the transfer of the next sector of the current request.
+ * For writes, the sector is copied to the on-card buffer first.
+ * Called with lh_lock held.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	if (lr->lr_iswrite) {
+		memcpy(lh->lh_buf, lhd_sectdata(lr), LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector + lr->lr_done);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Pick the next request, C-SCAN order: the lowest sector at or after
+ * the head position, or the lowest one overall once the sweep is
+ * over. Reads are synchronous (page faults wait for them) while
+ * writes are mostly background work (pageout), so reads go first, but
+ * only LHD_READBURST in a row while writes are waiting.
+ * Called with lh_lock held.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *lr, *ahead, *lowest;
+	bool reads = false, writes = false, wantwrite;
+
+	for (lr = lh->lh_queue; lr != NULL; lr = lr->lr_next) {
+		if (lr->lr_iswrite) {
+			writes = true;
+		}
+		else {
+			reads = true;
+		}
+	}
+	wantwrite = !reads || (writes && lh->lh_readburst >= LHD_READBURST);
+
+	ahead = lowest = NULL;
+	for (lr = lh->lh_queue; lr != NULL; lr = lr->lr_next) {
+		if (lr->lr_iswrite != wantwrite) {
+			continue;
+		}
+		if (lowest == NULL || lr->lr_sector < lowest->lr_sector) {
+			lowest = lr;
+		}
+		if (lr->lr_sector >= lh->lh_headpos &&
+		    (ahead == NULL || lr->lr_sector < ahead->lr_sector)) {
+			ahead = lr;
+		}
+	}
+	lr = ahead != NULL ? ahead : lowest;
+	KASSERT(lr != NULL);
+
+	if (lr->lr_iswrite || !writes) {
+		lh->lh_readburst = 0;
+	}
+	else {
+		lh->lh_readburst++;
+	}
+	return lr;
+}
+
+/*
+ * If the device is idle, hand it the next queued request.
+ * Called with lh_lock held.
+ */
+static
+void
+lhd_startreq(struct lhd_softc *lh)
+{
+	struct lhd_request *lr, **prev;
+	uint32_t dist;
+
+	if (lh->lh_cur != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+	lr = lhd_pick(lh);
+	for (prev = &lh->lh_queue; *prev != lr; prev = &(*prev)->lr_next);
+	*prev = lr->lr_next;
+	lh->lh_qlen--;
+
+	dist = lr->lr_sector > lh->lh_headpos ?
+		lr->lr_sector - lh->lh_headpos : lh->lh_headpos - lr->lr_sector;
+	if (dist != 0) {
+		lh->lh_stats.ls_seeks++;
+		lh->lh_stats.ls_seekdist += dist;
+	}
+
+	lh->lh_cur = lr;
+	lhd_startsect(lh);
+}
+
+/*
+ * Record that a sector has completed: save the data if reading, then
+ * either start the next sector of the request or, if the request is
+ * over, wake up its thread and start the next request.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *lr = lh->lh_cur, *merged;
+
+	KASSERT(lr != NULL);
+
+	if (err == 0 && !lr->lr_iswrite) {
+		membar_load_load();
+		memcpy(lhd_sectdata(lr), lh->lh_buf, LHD_SECTSIZE);
+	}
+	lr->lr_done++;
+	lr->lr_bufdone++;
+	if (lr->lr_bufdone*LHD_SECTSIZE == lr->lr_iov[lr->lr_iovdone].iov_len) {
+		lr->lr_iovdone++;
+		lr->lr_bufdone = 0;
+	}
+	lh->lh_headpos = lr->lr_sector + lr->lr_done;
+
+	if (err == 0 && lr->lr_done < lr->lr_nsect) {
+		lhd_startsect(lh);
+		return;
+	}
+
+	/* The waiting thread cannot return before we drop lh_lock */
+	merged = lr->lr_merged;
+	lr->lr_result = err;
+	lr->lr_complete = true;
+	lh->lh_cur = NULL;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+
+	if (merged != NULL) {
+		/*
+		 * Adjacent request: it is where the head is, so lhd_pick
+		 * takes it next unless the read burst is over.
+		 */
+		merged->lr_next = lh->lh_queue;
+		lh->lh_queue = merged;
+		lh->lh_qlen++;
+	}
+	lhd_startreq(lh);
 }
 
 /*
@@ -118,6 +279,8 @@ lhd_irq(void *vlh)
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
 
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -131,6 +294,8 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -179,6 +344,116 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * If the chain of requests starting at Q ends right where LR starts,
+ * going in the same direction, append LR to it: it is queued again
+ * when the request before it is over, right where the head is.
+ */
+static
+bool
+lhd_mergeinto(struct lhd_request *q, struct lhd_request *lr)
+{
+	for (; q->lr_merged != NULL; q = q->lr_merged);
+	if (q->lr_iswrite != lr->lr_iswrite ||
+	    q->lr_sector + q->lr_nsect != lr->lr_sector) {
+		return false;
+	}
+	q->lr_merged = lr;
+	return true;
+}
+
+/*
+ * Try merging LR behind the current request or a queued one.
+ * Called with lh_lock held.
+ */
+static
+bool
+lhd_merge(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	struct lhd_request *q;
+
+	if (lh->lh_cur != NULL && lhd_mergeinto(lh->lh_cur, lr)) {
+		return true;
+	}
+	for (q = lh->lh_queue; q != NULL; q = q->lr_next) {
+		if (lhd_mergeinto(q, lr)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Queue a request and wait until the interrupt handler has done all
+ * of its sectors.
+ */
+static
+int
+lhd_request(struct lhd_softc *lh, const struct iovec *iov, uint32_t sector,
+	    uint32_t nsect, bool iswrite)
+{
+	struct lhd_request lr;
+
+	lr.lr_iov = iov;
+	lr.lr_iovdone = 0;
+	lr.lr_bufdone = 0;
+	lr.lr_sector = sector;
+	lr.lr_nsect = nsect;
+	lr.lr_done = 0;
+	lr.lr_iswrite = iswrite;
+	lr.lr_complete = false;
+	lr.lr_result = 0;
+	lr.lr_next = NULL;
+	lr.lr_merged = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	lh->lh_stats.ls_requests++;
+	lh->lh_stats.ls_depthsum += lh->lh_qlen;
+	if (lh->lh_qlen > lh->lh_stats.ls_maxdepth) {
+		lh->lh_stats.ls_maxdepth = lh->lh_qlen;
+	}
+	if (lhd_merge(lh, &lr)) {
+		lh->lh_stats.ls_merges++;
+	}
+	else {
+		lr.lr_next = lh->lh_queue;
+		lh->lh_queue = &lr;
+		lh->lh_qlen++;
+		lhd_startreq(lh);
+	}
+	while (!lr.lr_complete) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lr.lr_result;
+}
+
+/*
+ * True if the data of UIO can be moved straight from the interrupt
+ * handler: kernel buffers, each holding whole sectors, covering
+ * exactly the transfer.
+ */
+static
+bool
+lhd_inplace(struct uio *uio)
+{
+	size_t total = 0;
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		if (uio->uio_iov[i].iov_len == 0 ||
+		    uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+		total += uio->uio_iov[i].iov_len;
+	}
+	return total == uio->uio_resid;
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -192,8 +467,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool iswrite = uio->uio_rw == UIO_WRITE;
+	struct iovec biov;
+	char *buf;
+	unsigned i;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +484,51 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+	/*
+	 * Kernel buffers made of whole sectors (swap pages, filesystem
+	 * blocks) are transferred in place. Anything else goes through a
+	 * bounce buffer, since the interrupt handler cannot touch user
+	 * memory.
+	 */
+	if (lhd_inplace(uio)) {
+		result = lhd_request(lh, uio->uio_iov, sector, len, iswrite);
+		if (result) {
+			return result;
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		for (i=0; i<uio->uio_iovcnt; i++) {
+			uio->uio_iov[i].iov_kbase =
+				(char *)uio->uio_iov[i].iov_kbase +
+				uio->uio_iov[i].iov_len;
+			uio->uio_iov[i].iov_len = 0;
 		}
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+	buf = kmalloc(len * LHD_SECTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	if (iswrite) {
+		result = uiomove(buf, len * LHD_SECTSIZE, uio);
 		if (result) {
+			kfree(buf);
 			return result;
 		}
 	}
-
-	return 0;
+	biov.iov_kbase = buf;
+	biov.iov_len = len * LHD_SECTSIZE;
+	result = lhd_request(lh, &biov, sector, len, iswrite);
+	if (result == 0 && !iswrite) {
+		result = uiomove(buf, len * LHD_SECTSIZE, uio);
+	}
+	kfree(buf);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,16 +551,21 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	lh->lh_cur = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_qlen = 0;
+	lh->lh_headpos = 0;
+	lh->lh_readburst = 0;
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+	if (lhdno < LHD_MAXUNITS) {
+		lhd_units[lhdno] = lh;
 	}
 
 	/* Set up the VFS device structure. */
@@ -306,3 +578,30 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
 }
+
+void
+lhd_printstats(void)
+{
+	struct lhd_softc *lh;
+	struct lhd_stats ls;
+	int i;
+
+	for (i=0; i<LHD_MAXUNITS; i++) {
+		lh = lhd_units[i];
+		if (lh == NULL) {
+			continue;
+		}
+		spinlock_acquire(&lh->lh_lock);
+		ls = lh->lh_stats;
+		spinlock_release(&lh->lh_lock);
+
+		kprintf("lhd%d: %u requests, %u merged, queue depth avg %u.%02u"
+			" max %u, %u seeks avg %llu sectors\n",
+			lh->lh_unit, ls.ls_requests, ls.ls_merges,
+			ls.ls_requests ? ls.ls_depthsum / ls.ls_requests : 0,
+			ls.ls_requests ?
+			(ls.ls_depthsum % ls.ls_requests) * 100 / ls.ls_requests : 0,
+			ls.ls_maxdepth, ls.ls_seeks,
+			ls.ls_seeks ? ls.ls_seekdist / ls.ls_seeks : 0);
+	}
+}
@@ -31,12 +31,46 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A transfer of one or more consecutive sectors. The interrupt handler
+ * moves each sector between the on-card buffer and the kernel buffers
+ * of lr_iov and starts the next one right away, so the requesting
+ * thread only sleeps once. The buffers need not be contiguous (a swap
+ * cluster goes to scattered frames), but each holds whole sectors.
+ */
+struct lhd_request {
+	const struct iovec *lr_iov;	/* Kernel buffers, filled or emptied in order */
+	unsigned lr_iovdone;		/* Buffers done so far */
+	uint32_t lr_bufdone;		/* Sectors done in the current buffer */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	uint32_t lr_done;		/* Sectors transferred so far */
+	bool lr_iswrite;
+	bool lr_complete;		/* Set by the interrupt handler */
+	int lr_result;
+	struct lhd_request *lr_next;	/* Next request in the queue */
+	struct lhd_request *lr_merged;	/* Adjacent request queued when this one is over */
+};
+
+/*
+ * Queue statistics, see lhd_printstats.
+ */
+struct lhd_stats {
+	uint32_t ls_requests;		/* Requests queued */
+	uint32_t ls_merges;		/* Requests merged behind an adjacent one */
+	uint32_t ls_depthsum;		/* Sum of the queue depths found by new requests */
+	uint32_t ls_maxdepth;
+	uint32_t ls_seeks;		/* Requests started after a seek */
+	uint64_t ls_seekdist;		/* Sum of the seek distances, in sectors */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +85,14 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct wchan *lh_wchan;		/* Threads waiting for their request */
+	struct lhd_request *lh_cur;	/* Request the device is working on */
+	struct lhd_request *lh_queue;	/* Requests waiting for the device, unordered */
+	unsigned lh_qlen;
+	uint32_t lh_headpos;		/* Sector after the last one transferred */
+	unsigned lh_readburst;		/* Reads served in a row while writes wait */
+	struct lhd_stats lh_stats;
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +100,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Print the request queue statistics of every disk */
+void lhd_printstats(void);
+
 #endif /* _LAMEBUS_LHD_H_ */
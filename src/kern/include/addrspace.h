@@ -40,6 +40,21 @@
 
 struct vnode;
 
+#if !OPT_DUMBVM
+/*
+ * File mapped with mmap. The mappings are placed top-down below the
+ * stack, the pages are read from the file on their first fault.
+ */
+struct mmap_region {
+        vaddr_t mr_start;               /* Page aligned */
+        size_t mr_npages;
+        struct vnode *mr_file;          /* Kept open as long as it is mapped */
+        off_t mr_offset;                /* File offset of mr_start, page aligned */
+        int mr_prot;                    /* PROT_* */
+        int mr_flags;                   /* MAP_SHARED or MAP_PRIVATE */
+        struct mmap_region *mr_next;
+};
+#endif
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -66,6 +81,19 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
+        uint32_t as_asid;               /* MIPS ASID tagging the TLB entries */
+        uint32_t as_asid_gen;           /* ASID generation as_asid belongs to */
+        struct vnode *as_file;          /* Executable the regions are loaded from on demand */
+        vaddr_t as_filevaddr1;          /* Start of the segment in region 1, not page aligned */
+        off_t as_offset1;               /* File offset of the segment in region 1 */
+        size_t as_filesize1;            /* Bytes of region 1 backed by the file, the rest is zero-filled */
+        vaddr_t as_filevaddr2;
+        off_t as_offset2;
+        size_t as_filesize2;
+        vaddr_t as_heapbase;            /* Start of the heap, right after the regions */
+        vaddr_t as_heaptop;             /* Current break: the heap pages are zero-filled on their first access */
+        struct mmap_region *as_mmaps;   /* Files mapped, from the last one */
+        vaddr_t as_mmapbase;            /* Lowest mapping, the heap can't grow past it */
 
 #endif
 };
@@ -108,6 +136,32 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - record where the segment loaded at VADDR is in
+ *                the executable, so that its pages can be read on
+ *                the first fault instead of being loaded upfront.
+ *
+ *    as_load_page - fill the frame at PADDR with the page at VADDR,
+ *                reading it from the executable. Returns false if
+ *                the page is not backed by the file and must be
+ *                zero-filled.
+ *
+ *    as_sbrk   - move the break of the heap by AMOUNT bytes, releasing
+ *                the pages past it when it shrinks. Hands back the
+ *                old break.
+ *
+ *    as_mmap   - map LEN bytes of the file V from OFFSET, below the
+ *                lowest mapping. Hands back the start of the mapping.
+ *
+ *    as_munmap - unmap the mapping starting at VADDR, writing back its
+ *                dirty pages if it is shared.
+ *
+ *    as_msync  - write back the dirty pages of the shared mappings in
+ *                the range.
+ *
+ *    as_munmap_all - unmap every mapping, on exit.
+ *
+ *    as_mmap_find - mapping holding VADDR, or NULL.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -130,6 +184,24 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if !OPT_DUMBVM
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
+bool              as_load_page(struct addrspace *as, vaddr_t vaddr,
+                               paddr_t paddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          size_t len, int prot, int flags, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr,
+                           size_t len);
+void              as_munmap_all(struct addrspace *as);
+struct mmap_region *as_mmap_find(struct addrspace *as, vaddr_t vaddr);
+#endif
 
 
 /*
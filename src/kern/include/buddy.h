@@ -0,0 +1,22 @@
+#ifndef __BUDDY__
+#define __BUDDY__
+#include <types.h>
+
+typedef struct buddy *buddy_allocator;
+
+// Buddy allocator for up to max_frames frames, with no free frame yet
+buddy_allocator buddyInit(uint32_t max_frames);
+
+// Make the frames 0..n_frames-1 free, n_frames <= max_frames
+void buddy_add_frames(buddy_allocator b, uint32_t n_frames);
+
+// Smallest order of a block of at least npages frames
+uint32_t buddy_order(uint32_t npages);
+
+// Take a free block of 2^order frames, return its first frame or -1 if there is none
+int buddy_alloc(buddy_allocator b, uint32_t order);
+
+// Give back the block of 2^order frames starting at first, merging it with its free buddies
+void buddy_free(buddy_allocator b, uint32_t first, uint32_t order);
+
+#endif
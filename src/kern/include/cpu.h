@@ -169,6 +169,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+struct cpu *cpu_bynumber(unsigned number);
 
 void interprocessor_interrupt(void);
 
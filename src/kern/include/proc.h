@@ -40,6 +40,7 @@
 #include <spinlock.h>
 #if OPT_PAGING
 #include <limits.h>
+#include <kern/time.h>
 #include <vm.h>
 #endif
 
@@ -85,10 +86,21 @@ struct proc {
 		uint32_t start_pt_i;			/*Page table index representing frames list head*/
 		uint32_t last_pt_i;				/*Page table index representing frames list tail*/
 		uint32_t n_frames;				/*Number of frames owned by the process*/
+		int start_alias_i;				/*Head of the list of frames shared copy-on-write with their owners, -1 if empty*/
+		uint32_t ra_window;				/*Pages read ahead after a swap fault, grown on hits and shrunk on misses*/
+		uint32_t fa_window;				/*Translations preloaded after a TLB miss, grown on sequential misses*/
+		vaddr_t fa_next;				/*Page following the last translation preloaded: the next miss if they are all used*/
+		uint32_t fa_pending;			/*Translations preloaded by the last miss, not known to be used or wasted yet*/
+		uint32_t ws_target;				/*Resident set target, following the page fault frequency, 0 before the first fault*/
+		struct timespec ws_last_fault;	/*Time of the last page fault*/
+		bool ws_suspended;				/*Swapped out by the load control: its faults wait until its working set fits in RAM*/
+		struct timespec ws_suspend_time;	/*Time it was swapped out*/
 #if LIST_ST
 		uint32_t start_st_i;			/*Swap table index representing chunks list head*/
 		uint32_t last_st_i;				/*Swap table index representing chunks list tail*/
 		uint32_t n_chunks;				/*Number of chunks owned by the process*/
+#else
+		int start_chunk_i;				/*Head of the list of chunks owned by the process, -1 if empty*/
 #endif
 		struct openfile *fileTable[OPEN_MAX];
 #endif
@@ -121,8 +133,10 @@ struct addrspace *proc_setas(struct addrspace *);
 
 /* wait for process termination, and return exit status */
 int proc_wait(struct proc *proc);
-/* get proc from pid */
+/* get proc from pid, NULL if no process has it */
 struct proc *proc_search_pid(pid_t pid);
+/* largest pid the process table has room for now: it grows on demand up to PID_MAX */
+pid_t proc_max_pid(void);
 
 void proc_signal_end(struct proc *proc);
 
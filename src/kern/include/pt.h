@@ -14,20 +14,79 @@ void addEntry(page_table pt, uint32_t page_n, uint32_t index, uint32_t pid);
 // Return the index (frame number) where page number is stored in, if page is not stored in memory, return -1
 int getFrameAddress(page_table pt, uint32_t page_n, bool frame);
 
-// Load new Page in the process address space, doing a swap-in from swapfile
+// Same as getFrameAddress, walking the process frames list instead of the hash anchor table (benchmark only)
+int getFrameAddressChain(page_table pt, uint32_t page_n, bool frame);
+
+// Load new Page in the process address space, doing a swap-in from swapfile.
+// Like every function below that can do I/O, it is called with vm_lock held and releases it while the frame is busy
 paddr_t pageIn (page_table pt, uint32_t pid, vaddr_t vaddr, swap_table st);
 
-uint32_t replace_page(page_table pt);
+// Choose the victim frame, skipping kernel and busy frames; -1 if there is none
+int replace_page(page_table pt);
+
+// Set the reference bit of the frame holding paddr on TLB refaults, used by the clock replacement.
+// The first access to a page read ahead grows the read-ahead window of the process
+void set_page_referenced(page_table pt, paddr_t paddr);
+
+// Mark the frame holding paddr as modified, so that it is written to the swap file when evicted
+void set_page_dirty(page_table pt, paddr_t paddr);
+
+// The current CPU is loading a translation of the frame holding paddr: it gets the shootdowns of the frame from now on
+void set_page_cached(page_table pt, paddr_t paddr);
+
+// True if the frame holding paddr can be mapped writable: it is dirty and it is not shared copy-on-write (the pages of
+// the shared file mappings are shared for good)
+bool is_page_writable(page_table pt, paddr_t paddr);
+
+// True if the frame holding paddr is in transit: a fault on it must wait on vm_wchan and look it up again
+bool is_page_busy(page_table pt, paddr_t paddr);
+
+// True if the translation of the frame holding paddr can be loaded in the TLB before the page is accessed: the first
+// access to a page read ahead, or to a page the clock is testing for references, has to fault
+bool is_page_preloadable(page_table pt, paddr_t paddr);
+
+// Give the current process its own copy of a frame shared copy-on-write, return the frame to map at vaddr
+paddr_t page_unshare(page_table pt, vaddr_t vaddr, paddr_t paddr, swap_table st);
 
 void all_proc_page_out(page_table pt);
 
+// Wait while the current process is swapped out by the load control, that is until the working sets of the processes
+// fit in RAM with its own or it has waited long enough. Called on every fault, with vm_lock held
+void ws_wait_active(page_table pt);
+
+// Number of frames in the free frames list
+uint32_t get_n_free_frames(page_table pt);
+
+// Free the next victim of the replacement policy, writing it to the swap file if dirty. Used by the pageout daemon,
+// return false if the victim could not be freed (free, kernel or shared frame)
+bool pageout_frame(page_table pt, swap_table st);
+
+// Allocate npages contiguous frames to the kernel from a buddy block, swapping out the user pages found there
 paddr_t alloc_n_contiguos_pages(uint32_t npages, page_table pt);
 
+// Free the kernel allocation starting at paddr
+void free_n_contiguos_pages(paddr_t paddr, page_table pt);
+
+// First physical address managed by the IPT
+paddr_t get_mem_base_addr(page_table pt);
+
 paddr_t insert_page(page_table pt, vaddr_t vaddr, swap_table ST, int suggested_frame_n);
 
 void remove_page(page_table pt, uint32_t frame_n);
 
-void pages_fork(page_table pt, uint32_t start_src_frame, pid_t dst_pid);
+// Free the frames of the pages of the current process in [start, end), both page aligned. Like pageIn, it releases vm_lock
+void pages_release(page_table pt, vaddr_t start, vaddr_t end);
+
+// Write the dirty pages of the shared file mappings of the current process in [start, end) back to their files.
+// Like pageIn, it releases vm_lock
+void pages_sync(page_table pt, vaddr_t start, vaddr_t end);
+
+// Share the resident pages of the current process copy-on-write with the process dst_pid
+void pages_fork(page_table pt, pid_t dst_pid);
+
+// Keep the frames of the current process in memory while it is forked, so that its pages are either shared or copied
+void pages_pin(page_table pt);
+void pages_unpin(page_table pt);
 
 void print_pt(page_table pt);
 
@@ -10,13 +10,26 @@ typedef struct swapTable *swap_table;
 
 swap_table swapTableInit(char swap_file_name[]);
 
-void swapout(swap_table st, uint32_t index, paddr_t paddr, uint32_t page_number, uint32_t pid, bool invalidate);
+// Write the frame at paddr into the chunk index and give the chunk to the page.
+// Called with vm_lock held, the chunk is busy and vm_lock is released during the write
+void swapout(swap_table st, uint32_t index, paddr_t paddr, uint32_t page_number, uint32_t pid);
 
-void swapin(swap_table st, uint32_t index, paddr_t paddr);
+// Write the n frames at paddrs, holding the pages page_numbers of the process pid, into the n chunks starting at index
+// with a single disk request. Like swapout, the chunks are busy and vm_lock is released during the write
+void swapout_cluster(swap_table st, uint32_t index, paddr_t *paddrs, uint32_t *page_numbers, uint32_t n, uint32_t pid);
+
+// Read the n chunks starting at index into the frames at paddrs, with a single disk request.
+// vm_lock is released during the read
+void swapin(swap_table st, uint32_t index, paddr_t *paddrs, uint32_t n);
+
+// True if the chunk index holds the page at vaddr of the process pid and it is not being written
+bool chunk_holds_page(swap_table st, uint32_t index, vaddr_t vaddr, pid_t pid);
 
 int getFirstFreeChunckIndex(swap_table st);
 
-void elf_to_swap(swap_table st, struct vnode *v, off_t offset, uint32_t init_page_n, size_t memsize, size_t filesize, pid_t PID);
+// First of n consecutive free chunks, -1 if there is no such run. They are to be written by swapout_cluster before
+// vm_lock is released
+int getFreeChunkRun(swap_table st, uint32_t n);
 
 int getSwapChunk(swap_table st, vaddr_t faultaddress, pid_t pid);
 
@@ -24,6 +37,9 @@ void all_proc_chunk_out(swap_table st);
 
 void chunks_fork(swap_table st, pid_t src_pid, pid_t dst_pid);
 
+// Free the chunks of the pages of the current process in [start, end), both page aligned. Called with vm_lock held
+void chunks_release(swap_table st, vaddr_t start, vaddr_t end);
+
 void print_chunks(swap_table st);
 
 void checkDuplicatedEntries(swap_table st);
@@ -61,7 +61,10 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 #if OPT_PAGING
 struct openfile;
+struct vnode;
 void openfileIncrRefCount(struct openfile *of);
+struct vnode *openfileGetVnode(int fd);
+int openfileGetMode(int fd);
 int sys_open(userptr_t path, int openflags, mode_t mode, int *errp);
 int sys_close(int fd);
 int sys_write(int fd, userptr_t buf_ptr, size_t size);
@@ -70,6 +73,10 @@ void sys__exit(int status);
 int sys_waitpid(pid_t pid, userptr_t statusp, int options);
 pid_t sys_getpid(void);
 int sys_fork(struct trapframe *ctf, pid_t *retval);
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(struct trapframe *tf, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
 #endif
 
 
@@ -95,6 +95,12 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+/* paging VM benchmarks */
+int iptbench(int, char **);
+int diskbench(int, char **);
+int diskstats(int, char **);
+int exitbench(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
@@ -61,28 +61,50 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Fold a shootdown into one already queued, called by ipi_tlbshootdown when the queue is full */
+void vm_tlbshootdown_merge(struct tlbshootdown *into, const struct tlbshootdown *ts);
+
 #if OPT_PAGING
-#define MAX_PROCESSES 64
+#define VM_MAXCPUS 32               /* Bound of the per-CPU state of the VM system (System/161 has at most 32 cpus) */
 #define PAGES_FOR_IPT 1
+#define RAND_RA 0                   /* Page replacement policies: a random victim, */
+#define FIFO_RA 1                   /* the oldest frame, */
+#define CLOCK_RA 2                  /* or the second-chance clock on the reference bits */
+#define RA FIFO_RA                  /* Page replacement policy in use */
 #define LIST_ST 0
-
-typedef struct{
-    vaddr_t vaddr_to_free;
-    uint32_t start_frame_n_to_remove, n_pages;
-    pid_t owner;
-    int next, prev;
-}kernel_frame;
+#define PAGEOUT_DAEMON 1            /* Free frames in the background with a kernel thread */
+#define PAGEOUT_LOW_WATERMARK 4     /* The pageout daemon is woken up when fewer frames than this are free */
+#define PAGEOUT_HIGH_WATERMARK 12   /* The pageout daemon goes back to sleep when this many frames are free */
+#define PAGEOUT_BATCH 32            /* Victims examined by the pageout daemon at every wake up, at most */
+#define ZSWAP 1                     /* Keep the evicted pages compressed in RAM, in front of the swap file */
+#define ZSWAP_POOL_PERCENT 20       /* Size of the pool of compressed pages, in percent of the RAM left to the VM system */
+#define SWAPOUT_CLUSTER 8           /* Dirty pages written to the swap file together with a victim, at most */
+#define READAHEAD_WINDOW 4          /* Pages read ahead after a swap fault, at first */
+#define READAHEAD_MAX_WINDOW 16     /* The read-ahead window grows with the hits up to this many pages */
+#define FAULTAROUND_WINDOW 2        /* Translations of the next resident pages loaded with a TLB miss, at first */
+#define FAULTAROUND_MAX_WINDOW 8    /* The fault-around window doubles on sequential misses up to this many pages, 0 disables it */
+#define VM_STACKPAGES 256           /* Room kept for the stack below USERSTACK: the heap does not grow into it */
+#define WS_INITIAL_TARGET 16        /* Resident set target of a process at its first page fault, in frames */
+#define WS_MIN_TARGET 4             /* The resident set target does not shrink below this many frames */
+#define PFF_GROW_MS 10              /* A page fault sooner than this after the previous one grows the resident set target */
+#define PFF_SHRINK_MS 100           /* Every this much time between two page faults shrinks it by a frame */
+#define LOAD_MAX_SUSPEND_MS 1000    /* A process swapped out by the load control comes back after this long anyway */
 
 int vm_enabled;
 swap_table ST;
 page_table IPT;
+/* Protects the IPT and the swap table. It is never held across I/O: frames and chunks in transit are marked busy */
 struct spinlock vm_lock;
-struct spinlock k_lock;
-kernel_frame *k_frames;
-int start_index_k, start_free_index;
-int frame_n_k;
+/* Threads waiting for a busy frame or chunk sleep here, with vm_lock */
+struct wchan *vm_wchan;
 /* Printing VM statistics when shooting down the VM system */
 void vm_shutdown(void); 
+#if PAGEOUT_DAEMON
+/* Start the pageout daemon, once the IPT and the swap table are set up */
+void pageout_bootstrap(void);
+/* Wake the pageout daemon up, if it is sleeping */
+void pageout_wakeup(void);
+#endif
 #endif
 
 
@@ -2,11 +2,23 @@
 #define __TLB_H__
 #include <types.h>
 
+struct addrspace;
+
 //These functions are wrappers for the low level TLB mips assembly implementation
 int TLB_Invalidate_all(void);
+//Load the ASID of the address space (giving it a new one if needed), flushing the TLB only on ASID rollover
+int TLB_Activate(struct addrspace *as);
 int TLB_Invalidate(paddr_t paddr);
-int TLB_Insert(vaddr_t faultaddress, paddr_t paddr);
-int tlb_get_rr_victim(void);
+//Drop the translations of the current address space for the pages in [start, end) from the TLB of this CPU
+int TLB_Invalidate_range(vaddr_t start, vaddr_t end);
+int TLB_Insert(vaddr_t faultaddress, paddr_t paddr, bool writable);
+//Load a translation ahead of its first access, in a free slot only. False if the TLB is full or already maps vaddr
+bool TLB_Preload(vaddr_t vaddr, paddr_t paddr, bool writable);
+//Drop the translations of the frame holding paddr from the TLBs of the CPUs in the mask cpus. The requests are
+//queued in batches, called with vm_lock held
+void TLB_Shootdown(paddr_t paddr, uint32_t cpus);
+//Send the batches queued and wait for the other CPUs to handle them. Called with vm_lock held, which is released while waiting
+void TLB_Shootdown_sync(void);
 int is_code_segment(vaddr_t vaddr);
 
 
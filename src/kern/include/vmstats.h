@@ -12,9 +12,6 @@
 #define VM_ELF      2
 #define VM_SWAP     3
 
-#define SWAP_0_FILLED   0
-#define SWAP_BLANK      1   
-
 
 void stat_bootstrap(void);
 
@@ -30,6 +27,25 @@ void add_TLB_fault_type(int free_entry);
 /* Number of times the *entire* TLB was invalidated (not the total entries invalidated) */
 void add_TLB_invalidation(void);
 
+/* Number of times all the ASIDs were taken and the TLB had to be flushed */
+void add_ASID_rollover(void);
+
+/* Number of address space switches that did not flush the TLB thanks to ASIDs */
+void add_TLB_flush_avoided(void);
+
+/* Number of TLB shootdown batches sent by the current CPU, for npages frames */
+void add_TLB_shootdown_sent(unsigned npages);
+
+/* Number of TLB shootdown batches handled by the current CPU */
+void add_TLB_shootdown_received(unsigned nbatches);
+
+/* Number of translations loaded in the TLB by fault-around, ahead of their first access */
+void add_TLB_preload(unsigned n);
+
+/* Number of translations preloaded that were accessed before the next TLB miss of the process, and that were not */
+void add_TLB_preload_used(unsigned n);
+void add_TLB_preload_wasted(unsigned n);
+
 /* Number of TLB misses for pages already in memory */
 void add_TLB_reload(void);
 
@@ -41,12 +57,72 @@ void add_TLB_reload(void);
 */
 void add_VM_pageFault(int type);
 
+/* Number of faults that had to wait for a page being read, written out or copied by another thread */
+void add_VM_busy_wait(void);
+
+/* Number of pages read from the swap file ahead of a fault, together with the faulting page */
+void add_VM_readahead(unsigned npages);
+
+/* Number of pages read ahead accessed before being evicted */
+void add_VM_readahead_hit(void);
+
+/* Number of pages read ahead evicted or freed without ever being accessed */
+void add_VM_readahead_miss(void);
+
+/* Number of pages evicted by a process over its resident set target to make room for its own faults */
+void add_WS_local_eviction(void);
+
+/* Number of processes swapped out by the load control, and let back in */
+void add_WS_suspension(void);
+void add_WS_resume(void);
+
+/* Number of text pages mapped from the frame of another process running the same executable */
+void add_TEXT_share(void);
+
+/* Frames saved by the shared text pages: delta is +1 when a process maps one, -1 when it stops */
+void add_TEXT_saved(int delta);
+
+/* Number of pages of a shared file mapping mapped from the frame of another process mapping the file */
+void add_MMAP_share(void);
+
+/* Number of dirty pages of shared file mappings written back to their files */
+void add_MMAP_writeback(void);
+
 /* Number of page faults that require writing a page to the swap file */
 void add_SWAP_write(void);
 
+/* Number of runs of npages pages written to the swap file with a single request, npages > 1 */
+void add_SWAP_cluster(unsigned npages);
+
+/* Number of pages kept in the swap cache, compressed to len bytes (0 for a page filled with the same word) */
+void add_ZSWAP_store(unsigned len);
+
+/* Number of pages that did not compress well enough for the swap cache */
+void add_ZSWAP_reject(void);
+
+/* Number of pages found in the swap cache on a swap fault */
+void add_ZSWAP_hit(void);
+
+/* Number of pages written back from the swap cache to the disk, to make room */
+void add_ZSWAP_writeback(void);
+
+/* Number of evictions of clean pages, which did not require writing to the swap file */
+void add_SWAP_clean_eviction(void);
+
+/* Number of pages shared copy-on-write with a child on fork */
+void add_COW_share(void);
+
+/* Number of writes to a shared page that required copying it to a new frame */
+void add_COW_copy(void);
+
+/* Number of times the pageout daemon was woken up below the low watermark */
+void add_PAGEOUT_wakeup(void);
+
+/* Number of dirty pages written to the swap file by the pageout daemon */
+void add_PAGEOUT_clean(void);
 
-/* Number of chunks zero-filled or blank (all zeros) on the swap file */
-void add_SWAP_chunk(int type);
+/* Number of frames freed by the pageout daemon */
+void add_PAGEOUT_free(void);
 
 /* Print out statistics and eventually some warnings, when shooting down the VM system */
 void print_stats(void);
@@ -0,0 +1,36 @@
+#ifndef __ZSWAP__
+#define __ZSWAP__
+#include <types.h>
+
+typedef struct zswap *zswap_pool;
+
+// Outcome of zswap_store
+#define ZSWAP_STORED 0      /* The page is kept in RAM */
+#define ZSWAP_FULL 1        /* No room left in the pool: write the oldest page back to the disk and retry */
+#define ZSWAP_REJECTED 2    /* The page does not compress well enough, it goes to the disk */
+
+// Compressed copies of the pages of n_chunks swap chunks, in a pool of pool_pages pages
+zswap_pool zswapInit(uint32_t n_chunks, uint32_t pool_pages);
+
+// Keep the page for the chunk index, replacing its previous copy. Pages filled with the same word take no room at all
+int zswap_store(zswap_pool z, uint32_t index, const void *page);
+
+// Copy the page of the chunk index into page, false if it is not in the pool
+bool zswap_load(zswap_pool z, uint32_t index, void *page);
+
+// Give the chunk dst a copy of the page of the chunk src, false if there is no room for it
+bool zswap_dup(zswap_pool z, uint32_t src, uint32_t dst);
+
+// True if the page of the chunk index is in the pool
+bool zswap_has(zswap_pool z, uint32_t index);
+
+// Forget the page of the chunk index, if any
+void zswap_drop(zswap_pool z, uint32_t index);
+
+// Least recently used chunk taking room in the pool, -1 if there is none
+int zswap_oldest(zswap_pool z);
+
+// Remove the page of the chunk index from the pool, decompressing it into page to write it back to the disk
+void zswap_evict(zswap_pool z, uint32_t index, void *page);
+
+#endif
@@ -49,6 +49,7 @@
 
 struct bitmap {
         unsigned nbits;
+        unsigned firstfree;     /* no bit below this one is clear */
         WORD_TYPE *v;
 };
 
@@ -72,6 +73,7 @@ bitmap_create(unsigned nbits)
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->firstfree = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -102,7 +104,20 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
         unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
+        for (ix=b->firstfree/BITS_PER_WORD; ix<maxix; ix++) {
+                /*
+                 * Skip full words four at a time once aligned. All
+                 * the bytes are 0xff, so the byte order does not
+                 * matter.
+                 */
+                while (ix % sizeof(uint32_t) == 0 &&
+                       ix + sizeof(uint32_t) <= maxix &&
+                       *(uint32_t *)&b->v[ix] == 0xffffffff) {
+                        ix += sizeof(uint32_t);
+                }
+                if (ix >= maxix) {
+                        break;
+                }
                 if (b->v[ix]!=WORD_ALLBITS) {
                         for (offset = 0; offset < BITS_PER_WORD; offset++) {
                                 WORD_TYPE mask = ((WORD_TYPE)1) << offset;
@@ -111,6 +126,7 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
                                         b->v[ix] |= mask;
                                         *index = (ix*BITS_PER_WORD)+offset;
                                         KASSERT(*index < b->nbits);
+                                        b->firstfree = *index + 1;
                                         return 0;
                                 }
                         }
@@ -155,6 +171,9 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        if (index < b->firstfree) {
+                b->firstfree = index;
+        }
 }
 
 
@@ -45,6 +45,7 @@
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-paging.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -564,6 +565,12 @@ static const char *testmenu[] = {
 	"[tt3] Thread test 3                 ",
 #if OPT_NET
 	"[net] Network test                  ",
+#endif
+#if OPT_PAGING
+	"[vm1] IPT lookup benchmark          ",
+	"[vm2] Disk throughput benchmark     ",
+	"[vm3] Disk queue statistics         ",
+	"[vm4] Exit latency benchmark        ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
@@ -663,6 +670,12 @@ static struct {
 	{ "km4",	kmalloctest4 },
 #if OPT_NET
 	{ "net",	nettest },
+#endif
+#if OPT_PAGING
+	{ "vm1",	iptbench },
+	{ "vm2",	diskbench },
+	{ "vm3",	diskstats },
+	{ "vm4",	exitbench },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
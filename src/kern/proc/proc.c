@@ -53,10 +53,12 @@
 #include <synch.h>
 #include <syscall.h>
 
-#define MAX_PROC 100
+#define PROC_TABLE_INIT 64	/* initial number of slots, doubled when full */
+
 static struct _processTable {
   int active;           /* initial value 0 */
-  struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
+  struct proc **proc;   /* [0] not used. pids are >= 1 */
+  int size;             /* number of slots: pids go from 1 to size-1 */
   int last_i;           /* index of last allocated pid */
   struct spinlock lk;	/* Lock for this table */
 } processTable;
@@ -70,10 +72,14 @@ struct proc *kproc;
 
 struct proc * proc_search_pid(pid_t pid) {
 #if OPT_PAGING
-  struct proc *p;
-  KASSERT(pid>=0&&pid<MAX_PROC);
-  p = processTable.proc[pid];
-  KASSERT(p->p_pid==pid);
+  struct proc *p = NULL;
+  KASSERT(pid>=0&&pid<=PID_MAX);
+  spinlock_acquire(&processTable.lk);
+  if (pid<processTable.size) {
+    p = processTable.proc[pid];
+  }
+  spinlock_release(&processTable.lk);
+  KASSERT(p==NULL||p->p_pid==pid);
   return p;
 #else
   (void)pid;
@@ -81,25 +87,84 @@ struct proc * proc_search_pid(pid_t pid) {
 #endif
 }
 
+pid_t proc_max_pid(void) {
+#if OPT_PAGING
+  pid_t max;
+  spinlock_acquire(&processTable.lk);
+  max = processTable.size-1;
+  spinlock_release(&processTable.lk);
+  return max;
+#else
+  return 0;
+#endif
+}
+
+#if OPT_PAGING
+/*
+ * Double the process table, up to PID_MAX+1 slots: pids must fit the
+ * 16 bit owner fields of the page and swap tables.
+ * Called and returns without holding the table lock; false if the table
+ * cannot grow.
+ */
+static bool proc_table_grow(int old_size) {
+  struct proc **newproc, **oldproc;
+  int i, newsize;
+
+  newsize = old_size==0 ? PROC_TABLE_INIT : 2*old_size;
+  if (newsize>PID_MAX+1) newsize = PID_MAX+1;
+  if (newsize<=old_size) {
+    return false;
+  }
+  newproc = kmalloc(newsize*sizeof(struct proc *));
+  if (newproc == NULL) {
+    return false;
+  }
+  spinlock_acquire(&processTable.lk);
+  if (processTable.size != old_size) {
+    /* somebody else grew it meanwhile */
+    spinlock_release(&processTable.lk);
+    kfree(newproc);
+    return true;
+  }
+  for (i=0; i<newsize; i++) {
+    newproc[i] = i<old_size ? processTable.proc[i] : NULL;
+  }
+  oldproc = processTable.proc;
+  processTable.proc = newproc;
+  processTable.size = newsize;
+  spinlock_release(&processTable.lk);
+  if (oldproc != NULL) {
+    kfree(oldproc);
+  }
+  return true;
+}
+#endif
+
 static void proc_init_waitpid(struct proc *proc, const char *name) {
 #if OPT_PAGING
   /* search a free index in table using a circular strategy */
-  int i;
-  spinlock_acquire(&processTable.lk);
-  i = processTable.last_i+1;
+  int i, size;
   proc->p_pid = 0;
-  if (i>MAX_PROC) i=1;
-  while (i!=processTable.last_i) {
-    if (processTable.proc[i] == NULL) {
-      processTable.proc[i] = proc;
-      processTable.last_i = i;
-      proc->p_pid = i;
+  for (;;) {
+    spinlock_acquire(&processTable.lk);
+    size = processTable.size;
+    i = processTable.last_i+1;
+    if (i>=size) i=1;
+    while (size>1 && i!=processTable.last_i) {
+      if (processTable.proc[i] == NULL) {
+        processTable.proc[i] = proc;
+        processTable.last_i = i;
+        proc->p_pid = i;
+        break;
+      }
+      i++;
+      if (i>=size) i=1;
+    }
+    spinlock_release(&processTable.lk);
+    if (proc->p_pid!=0 || !proc_table_grow(size)) {
       break;
     }
-    i++;
-    if (i>MAX_PROC) i=1;
   }
-  spinlock_release(&processTable.lk);
   if (proc->p_pid==0) {
     panic("too many processes. proc table is full\n");
   }
@@ -122,7 +187,7 @@ static void proc_end_waitpid(struct proc *proc) {
   int i;
   spinlock_acquire(&processTable.lk);
   i = proc->p_pid;
-  KASSERT(i>0 && i<=MAX_PROC);
+  KASSERT(i>0 && i<processTable.size);
   processTable.proc[i] = NULL;
   spinlock_release(&processTable.lk);
 
@@ -166,10 +231,19 @@ proc_create(const char *name)
 	proc->start_pt_i = 0;
 	proc->last_pt_i = 0;
 	proc->n_frames = 0;
+	proc->start_alias_i = -1;
+	proc->ra_window = READAHEAD_WINDOW;
+	proc->fa_window = FAULTAROUND_WINDOW;
+	proc->fa_next = 0;
+	proc->fa_pending = 0;
+	proc->ws_target = 0;
+	proc->ws_suspended = false;
 #if LIST_ST
 	proc->start_st_i = 0;
 	proc->last_st_i = 0;
 	proc->n_chunks = 0;
+#else
+	proc->start_chunk_i = -1;
 #endif
 #endif
 
@@ -6,6 +6,7 @@
 
 #include <types.h>
 #include <kern/unistd.h>
+#include <kern/fcntl.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -25,6 +26,7 @@
 struct openfile {
   struct vnode *vn;
   off_t offset;	
+  int mode;		/* O_RDONLY, O_WRONLY or O_RDWR */
   unsigned int countRef;
 };
 
@@ -35,6 +37,24 @@ void openfileIncrRefCount(struct openfile *of) {
     of->countRef++;
 }
 
+struct vnode *openfileGetVnode(int fd) {
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return NULL;
+  of = curproc->fileTable[fd];
+  if (of==NULL) return NULL;
+  return of->vn;
+}
+
+int openfileGetMode(int fd) {
+  struct openfile *of;
+
+  if (fd<0||fd>=OPEN_MAX) return -1;
+  of = curproc->fileTable[fd];
+  if (of==NULL) return -1;
+  return of->mode;
+}
+
 static int
 file_read(int fd, userptr_t buf_ptr, size_t size) {
   struct iovec iov;
@@ -113,6 +133,7 @@ sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
       of = &systemFileTable[i];
       of->vn = v;
       of->offset = 0; // TODO: handle offset with append
+      of->mode = openflags & O_ACCMODE;
       of->countRef = 1;
       break;
     }
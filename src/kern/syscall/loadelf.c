@@ -60,10 +60,6 @@
 #include <vnode.h>
 #include <elf.h>
 #include <opt-paging.h>
-#if OPT_PAGING
-#include <vm.h>
-#include <current.h>
-#endif
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -87,10 +83,14 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     int is_executable)
 {
 #if OPT_PAGING
-	elf_to_swap(ST, v, offset, vaddr >> 12, memsize, filesize, curproc->p_pid);
-	(void)as;
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	/* The pages are read from the file on the first fault */
 	(void)is_executable;
-	return 0;
+	return as_define_file(as, v, offset, vaddr, filesize);
 #else
 	struct iovec iov;
 	struct uio u;
@@ -29,11 +29,16 @@ sys__exit(int status)
   struct proc *p = curproc;
   p->p_status = status & 0xff; /* just lower 8 bits returned */
 
+  // the shared file mappings write their changes back before the pages go
+  as_munmap_all(proc_getas());
+
+  spinlock_acquire(&vm_lock);
   // invalidate all the page of the process that has called the exit
   all_proc_page_out(IPT);
 
   // Invalidate all process chunks
   all_proc_chunk_out(ST);
+  spinlock_release(&vm_lock);
   
   proc_remthread(curthread);
   proc_signal_end(p);
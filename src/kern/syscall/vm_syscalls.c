@@ -0,0 +1,101 @@
+/*
+ * Memory management system calls of the paging VM system.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <syscall.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vnode.h>
+#include <kern/mman.h>
+#include <machine/trapframe.h>
+
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+  struct addrspace *as = proc_getas();
+  vaddr_t oldbreak;
+  int result;
+
+  KASSERT(as != NULL);
+  result = as_sbrk(as, amount, &oldbreak);
+  if (result) {
+    return result;
+  }
+  *retval = (int32_t)oldbreak;
+  return 0;
+}
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset): the fd and the 64-bit
+ * offset don't fit in the argument registers, they are on the user
+ * stack, the offset aligned to 8 bytes.
+ */
+int
+sys_mmap(struct trapframe *tf, int32_t *retval)
+{
+  struct addrspace *as = proc_getas();
+  struct vnode *vn;
+  size_t len = (size_t)tf->tf_a1;
+  int prot = (int)tf->tf_a2, flags = (int)tf->tf_a3, fd, mode;
+  off_t offset;
+  vaddr_t start;
+  int result;
+
+  KASSERT(as != NULL);
+  result = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+  if (result) {
+    return result;
+  }
+  result = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+  if (result) {
+    return result;
+  }
+  vn = openfileGetVnode(fd);
+  if (vn == NULL) {
+    return EBADF;
+  }
+  /* the pages are read from the file, and a shared one written back to it */
+  mode = openfileGetMode(fd);
+  if (mode == O_WRONLY ||
+      (flags == MAP_SHARED && (prot & PROT_WRITE) && mode != O_RDWR)) {
+    return EACCES;
+  }
+  /* the address hint is ignored, only files that support it can be mapped */
+  if (VOP_MMAP(vn)) {
+    return ENODEV;
+  }
+  result = as_mmap(as, vn, len, prot, flags, offset, &start);
+  if (result) {
+    return result;
+  }
+  *retval = (int32_t)start;
+  return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as = proc_getas();
+
+  KASSERT(as != NULL);
+  return as_munmap(as, (vaddr_t)addr, len);
+}
+
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+  struct addrspace *as = proc_getas();
+
+  KASSERT(as != NULL);
+  /* the writes are synchronous anyway */
+  if ((flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+    return EINVAL;
+  }
+  return as_msync(as, (vaddr_t)addr, len);
+}
@@ -33,6 +33,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <cpu.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -51,13 +53,19 @@
  * available memory.
  *
  * kmallocstress does the same thing, but from NTHREADS different
- * threads at once.
+ * threads at once. Then it measures the throughput of small
+ * allocations with 1, 2, 4 ... NTHREADS threads, to see how it grows
+ * with the number of cpus.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+#define TPUT_ROUNDS  500
+#define TPUT_NLIVE   8
+#define TPUT_SIZE(k) (12 << ((k) % 8))	/* 12 to 1536: every subpage size */
+
 static
 void
 kmallocthread(void *sm, unsigned long num)
@@ -97,6 +105,69 @@ done:
 	}
 }
 
+/*
+ * Throughput thread: each round allocates TPUT_NLIVE blocks of
+ * various sizes and frees them.
+ */
+static
+void
+kmalloctputthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[TPUT_NLIVE];
+	unsigned i, j;
+
+	for (i=0; i<TPUT_ROUNDS; i++) {
+		for (j=0; j<TPUT_NLIVE; j++) {
+			ptrs[j] = kmalloc(TPUT_SIZE(num + i + j));
+			if (ptrs[j] == NULL) {
+				kprintf("thread %lu: kmalloc returned NULL\n",
+					num);
+				break;
+			}
+		}
+		while (j > 0) {
+			kfree(ptrs[--j]);
+		}
+	}
+	V(sem);
+}
+
+/*
+ * Run NTHREADS throughput threads, return the allocations (each with
+ * its free) per millisecond.
+ */
+static
+uint64_t
+kmalloctput(struct semaphore *sem, unsigned nthreads)
+{
+	struct timespec before, after, duration;
+	uint64_t ns;
+	unsigned i;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmalloctput", NULL,
+				     kmalloctputthread, sem, i);
+		if (result) {
+			panic("kmallocstress: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &duration);
+	ns = duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (uint64_t)nthreads * TPUT_ROUNDS * TPUT_NLIVE * 1000000 / ns;
+}
+
 int
 kmalloctest(int nargs, char **args)
 {
@@ -114,6 +185,7 @@ int
 kmallocstress(int nargs, char **args)
 {
 	struct semaphore *sem;
+	unsigned ncpus, nthreads;
 	int i, result;
 
 	(void)nargs;
@@ -139,6 +211,12 @@ kmallocstress(int nargs, char **args)
 		P(sem);
 	}
 
+	for (ncpus=0; cpu_bynumber(ncpus) != NULL; ncpus++);
+	for (nthreads=1; nthreads<=NTHREADS; nthreads*=2) {
+		kprintf("kmallocstress: %u threads, %u cpus: %llu allocs/ms\n",
+			nthreads, ncpus, kmalloctput(sem, nthreads));
+	}
+
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
 
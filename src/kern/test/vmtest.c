@@ -0,0 +1,398 @@
+/*
+ * Benchmarks for the paging VM system.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <pt.h>
+#include <swapfile.h>
+#include <test.h>
+#include <lamebus/lhd.h>
+
+#define IPTB_NPAGES  32
+#define IPTB_ROUNDS  200
+
+#define EXITB_NPAGES  64
+#define EXITB_SIZES   3
+#define EXITB_TEXT    0x400000
+#define EXITB_DATA    0x10000000
+
+#define DISKB_NBLOCKS  64
+#define DISKB_DEVICE   "lhd1raw:"
+
+static
+uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/*
+ * Average cost of the page number -> frame lookup done on every TLB
+ * miss, comparing the old walk of the process frames list with the
+ * hash anchor table. The frames looked up are kernel pages owned by
+ * the menu process, so the list is at least NPAGES long.
+ */
+static
+uint64_t
+iptbench_run(vaddr_t *pages, unsigned npages, bool chain)
+{
+	struct timespec before, after, duration;
+	unsigned i, j;
+	int frame_n;
+
+	/* vm_lock keeps the IPT still, and is what vm_fault pays on a miss */
+	spinlock_acquire(&vm_lock);
+	gettime(&before);
+	for (i=0; i<IPTB_ROUNDS; i++) {
+		for (j=0; j<npages; j++) {
+			if (chain) {
+				frame_n = getFrameAddressChain(IPT,
+						pages[j] >> 12, true);
+			}
+			else {
+				frame_n = getFrameAddress(IPT,
+						pages[j] >> 12, true);
+			}
+			if (frame_n == -1) {
+				panic("iptbench: page 0x%x not found\n",
+				      pages[j]);
+			}
+		}
+	}
+	gettime(&after);
+	spinlock_release(&vm_lock);
+
+	timespec_sub(&after, &before, &duration);
+	return timespec_to_ns(&duration) / (IPTB_ROUNDS * npages);
+}
+
+int
+iptbench(int nargs, char **args)
+{
+	vaddr_t *pages;
+	unsigned npages, i;
+	uint64_t chain_ns, hash_ns;
+
+	npages = IPTB_NPAGES;
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if (npages == 0) {
+		kprintf("Usage: vm1 [npages]\n");
+		return EINVAL;
+	}
+
+	pages = kmalloc(npages * sizeof(*pages));
+	if (pages == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<npages; i++) {
+		pages[i] = alloc_kpages(1);
+		if (pages[i] == 0) {
+			kprintf("iptbench: out of memory after %u pages\n", i);
+			npages = i;
+			break;
+		}
+	}
+
+	kprintf("iptbench: %u pages, %u frames owned by %s\n",
+		npages, curproc->n_frames, curproc->p_name);
+	chain_ns = iptbench_run(pages, npages, true);
+	hash_ns = iptbench_run(pages, npages, false);
+	kprintf("iptbench: frames list walk:  %llu ns/lookup\n", chain_ns);
+	kprintf("iptbench: hash anchor table: %llu ns/lookup\n", hash_ns);
+
+	for (i=0; i<npages; i++) {
+		free_kpages(pages[i]);
+	}
+	kfree(pages);
+
+	kprintf("iptbench done.\n");
+	return 0;
+}
+
+/*
+ * Time NBLOCKS page-sized transfers on the raw disk V, at consecutive
+ * or random offsets. Writes put back what was just read, so that the
+ * disk contents are preserved; only the writes are timed.
+ */
+static
+int
+diskbench_run(struct vnode *v, char *buf, unsigned dblocks, unsigned nblocks,
+	      bool random_io, bool write, uint64_t *ns)
+{
+	struct timespec before, after, duration;
+	struct iovec iov;
+	struct uio ku;
+	unsigned i, block;
+	int result;
+
+	*ns = 0;
+	for (i=0; i<nblocks; i++) {
+		block = random_io ? random() % dblocks : i % dblocks;
+		if (write) {
+			uio_kinit(&iov, &ku, buf, PAGE_SIZE,
+				  (off_t)block * PAGE_SIZE, UIO_READ);
+			result = VOP_READ(v, &ku);
+			if (result) {
+				return result;
+			}
+		}
+		uio_kinit(&iov, &ku, buf, PAGE_SIZE, (off_t)block * PAGE_SIZE,
+			  write ? UIO_WRITE : UIO_READ);
+		gettime(&before);
+		result = write ? VOP_WRITE(v, &ku) : VOP_READ(v, &ku);
+		gettime(&after);
+		if (result) {
+			return result;
+		}
+		timespec_sub(&after, &before, &duration);
+		*ns += timespec_to_ns(&duration);
+	}
+	return 0;
+}
+
+static
+void
+diskbench_print(const char *what, unsigned nblocks, uint64_t ns)
+{
+	uint64_t kbps;
+
+	if (ns == 0) {
+		ns = 1;
+	}
+	kbps = (uint64_t)nblocks * PAGE_SIZE * 1000000000ULL / 1024 / ns;
+	kprintf("diskbench: %-18s %llu.%02llu MB/s\n", what,
+		kbps / 1024, (kbps % 1024) * 100 / 1024);
+}
+
+/*
+ * Throughput of the raw disk with 4K requests, sequential and random,
+ * read and (re)write. The default device is the second disk, since
+ * the first one is the swap area.
+ */
+int
+diskbench(int nargs, char **args)
+{
+	char devname[32];
+	struct vnode *v;
+	struct stat st;
+	char *buf;
+	unsigned nblocks, dblocks;
+	uint64_t ns;
+	int result;
+
+	strcpy(devname, DISKB_DEVICE);
+	nblocks = DISKB_NBLOCKS;
+	if (nargs > 1) {
+		snprintf(devname, sizeof(devname), "%s", args[1]);
+	}
+	if (nargs > 2) {
+		nblocks = atoi(args[2]);
+	}
+	if (nblocks == 0) {
+		kprintf("Usage: vm2 [device [nblocks]]\n");
+		return EINVAL;
+	}
+
+	/* vfs_open may destroy the name it is passed */
+	result = vfs_open(devname, O_RDWR, 0, &v);
+	if (result) {
+		kprintf("diskbench: vfs_open: %s\n", strerror(result));
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		vfs_close(v);
+		return result;
+	}
+	dblocks = st.st_size / PAGE_SIZE;
+	if (dblocks == 0) {
+		vfs_close(v);
+		return EINVAL;
+	}
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	kprintf("diskbench: %u blocks of %u bytes, disk of %u blocks\n",
+		nblocks, PAGE_SIZE, dblocks);
+	result = diskbench_run(v, buf, dblocks, nblocks, false, false, &ns);
+	if (result == 0) {
+		diskbench_print("sequential read:", nblocks, ns);
+		result = diskbench_run(v, buf, dblocks, nblocks, true, false,
+				       &ns);
+	}
+	if (result == 0) {
+		diskbench_print("random read:", nblocks, ns);
+		result = diskbench_run(v, buf, dblocks, nblocks, false, true,
+				       &ns);
+	}
+	if (result == 0) {
+		diskbench_print("sequential write:", nblocks, ns);
+		result = diskbench_run(v, buf, dblocks, nblocks, true, true,
+				       &ns);
+	}
+	if (result == 0) {
+		diskbench_print("random write:", nblocks, ns);
+		lhd_printstats();
+	}
+	else {
+		kprintf("diskbench: %s\n", strerror(result));
+	}
+
+	kfree(buf);
+	vfs_close(v);
+	kprintf("diskbench done.\n");
+	return result;
+}
+
+/*
+ * Request queue statistics of the disks, since boot.
+ */
+int
+diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lhd_printstats();
+	return 0;
+}
+
+/*
+ * Exit latency of a process with a large resident set. The process has
+ * no program: its thread builds an address space, faults in NPAGES
+ * zero-filled data pages writing to them, and times the release of its
+ * frames and swap chunks done by _exit. The run is repeated doubling
+ * the pages: with the frames lists linked both ways the time per page
+ * should stay flat instead of growing with the resident set.
+ */
+
+struct exitbench_run {
+	struct semaphore *done;
+	unsigned npages;
+	unsigned nframes;
+	uint64_t ns;
+	int result;
+};
+
+static
+void
+exitbench_thread(void *data1, unsigned long data2)
+{
+	struct exitbench_run *run = data1;
+	struct addrspace *as;
+	struct timespec before, after, duration;
+	unsigned i;
+	int word = 1;
+
+	(void)data2;
+
+	as = as_create();
+	if (as == NULL) {
+		run->result = ENOMEM;
+		goto out;
+	}
+	proc_setas(as);
+	as_activate();
+	as_define_region(as, EXITB_TEXT, PAGE_SIZE, 1, 0, 1);
+	as_define_region(as, EXITB_DATA, run->npages * PAGE_SIZE, 1, 1, 0);
+	as_complete_load(as);
+
+	for (i=0; i<run->npages; i++) {
+		run->result = copyout(&word,
+			(userptr_t)(EXITB_DATA + i * PAGE_SIZE), sizeof(word));
+		if (run->result) {
+			break;
+		}
+	}
+
+	/* the same teardown as sys__exit, timed */
+	spinlock_acquire(&vm_lock);
+	run->nframes = curproc->n_frames;
+	gettime(&before);
+	all_proc_page_out(IPT);
+	all_proc_chunk_out(ST);
+	gettime(&after);
+	spinlock_release(&vm_lock);
+
+	timespec_sub(&after, &before, &duration);
+	run->ns = timespec_to_ns(&duration);
+ out:
+	proc_remthread(curthread);
+	V(run->done);
+	thread_exit();
+}
+
+int
+exitbench(int nargs, char **args)
+{
+	struct exitbench_run run;
+	struct proc *proc;
+	unsigned npages, i;
+	int result;
+
+	npages = EXITB_NPAGES;
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if (npages == 0) {
+		kprintf("Usage: vm4 [npages]\n");
+		return EINVAL;
+	}
+
+	run.done = sem_create("exitbench", 0);
+	if (run.done == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<EXITB_SIZES; i++, npages *= 2) {
+		proc = proc_create_runprogram("exitbench");
+		if (proc == NULL) {
+			sem_destroy(run.done);
+			return ENOMEM;
+		}
+		run.npages = npages;
+		run.nframes = 0;
+		run.ns = 0;
+		run.result = 0;
+		result = thread_fork("exitbench", proc, exitbench_thread,
+				     &run, 0);
+		if (result) {
+			proc_destroy(proc);
+			sem_destroy(run.done);
+			return result;
+		}
+		P(run.done);
+		proc_destroy(proc);
+		if (run.result) {
+			kprintf("exitbench: %u pages: %s\n", npages,
+				strerror(run.result));
+			sem_destroy(run.done);
+			return run.result;
+		}
+		kprintf("exitbench: %u pages, %u resident: %llu us, "
+			"%llu ns/page\n", npages, run.nframes, run.ns / 1000,
+			run.ns / npages);
+	}
+	sem_destroy(run.done);
+
+	kprintf("exitbench done.\n");
+	return 0;
+}
@@ -1128,6 +1128,19 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Look up a CPU by its software number. Returns NULL if there is no
+ * such CPU.
+ */
+struct cpu *
+cpu_bynumber(unsigned number)
+{
+	if (number >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Send a TLB shootdown IPI to the specified CPU.
  */
@@ -1141,15 +1154,11 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	n = target->c_numshootdown;
 	if (n == TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * The target has not caught up yet: coalesce the
+		 * request with the last one queued. The VM system
+		 * can't sleep here, it holds its own lock.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		vm_tlbshootdown_merge(&target->c_shootdown[n-1], mapping);
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
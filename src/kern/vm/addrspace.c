@@ -37,6 +37,10 @@
 #if OPT_PAGING
 #include <vm_tlb.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <kern/mman.h>
 #endif
 
 /*
@@ -64,6 +68,19 @@ as_create(void)
 	as->as_vbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	as->as_file = NULL;
+	as->as_filevaddr1 = 0;
+	as->as_offset1 = 0;
+	as->as_filesize1 = 0;
+	as->as_filevaddr2 = 0;
+	as->as_offset2 = 0;
+	as->as_filesize2 = 0;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_mmaps = NULL;
+	as->as_mmapbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
 #endif
 	return as;
 }
@@ -72,6 +89,7 @@ as_create(void)
 int as_copy(struct addrspace *src, struct addrspace **ret, pid_t new_pid){
 	
 	struct addrspace *newas;
+	struct mmap_region *mr, *newmr, **tail;
 
 	newas = as_create();
 	if (newas==NULL) {
@@ -82,9 +100,42 @@ int as_copy(struct addrspace *src, struct addrspace **ret, pid_t new_pid){
 	newas->as_npages1 = src->as_npages1;
 	newas->as_vbase2 = src->as_vbase2;
 	newas->as_npages2 = src->as_npages2;
+	//the pages the parent never touched are still read from the executable
+	newas->as_file = src->as_file;
+	if (newas->as_file != NULL) {
+		VOP_INCREF(newas->as_file);
+	}
+	newas->as_filevaddr1 = src->as_filevaddr1;
+	newas->as_offset1 = src->as_offset1;
+	newas->as_filesize1 = src->as_filesize1;
+	newas->as_filevaddr2 = src->as_filevaddr2;
+	newas->as_offset2 = src->as_offset2;
+	newas->as_filesize2 = src->as_filesize2;
+	newas->as_heapbase = src->as_heapbase;
+	newas->as_heaptop = src->as_heaptop;
+	//the child maps the same files, the shared mappings keep sharing the frames
+	tail = &newas->as_mmaps;
+	for (mr = src->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		newmr = kmalloc(sizeof(*newmr));
+		if (newmr == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newmr = *mr;
+		newmr->mr_next = NULL;
+		VOP_INCREF(newmr->mr_file);
+		*tail = newmr;
+		tail = &newmr->mr_next;
+	}
+	newas->as_mmapbase = src->as_mmapbase;
 
+	//the parent pages can't be evicted until both copies are done
+	spinlock_acquire(&vm_lock);
+	pages_pin(IPT);
 	chunks_fork(ST, curproc->p_pid, new_pid);
-	pages_fork(IPT, curproc->start_pt_i, new_pid);
+	pages_fork(IPT, new_pid);
+	pages_unpin(IPT);
+	spinlock_release(&vm_lock);
 	*ret = newas;
 	return 0;
 
@@ -115,6 +166,20 @@ as_destroy(struct addrspace *as)
 	/*
 	 * Clean up as needed.
 	 */
+#if OPT_PAGING
+	struct mmap_region *mr;
+
+	if (as->as_file != NULL) {
+		vfs_close(as->as_file);
+	}
+	//the pages are gone already, as_munmap_all wrote back the shared ones
+	while (as->as_mmaps != NULL) {
+		mr = as->as_mmaps;
+		as->as_mmaps = mr->mr_next;
+		vfs_close(mr->mr_file);
+		kfree(mr);
+	}
+#endif
 
 	kfree(as);
 }
@@ -137,7 +202,7 @@ as_activate(void)
 	 * Write this.
 	 */
 #if OPT_PAGING
-	TLB_Invalidate_all();
+	TLB_Activate(as);
 #endif
 }
 
@@ -212,11 +277,17 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+#if OPT_PAGING
+	vaddr_t end1, end2;
 
+	/* The heap starts empty, on the first page after the regions */
+	end1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	end2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	as->as_heapbase = end1 > end2 ? end1 : end2;
+	as->as_heaptop = as->as_heapbase;
+#else
 	(void)as;
+#endif
 	return 0;
 }
 
@@ -235,4 +306,264 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+#if OPT_PAGING
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize)
+{
+	if ((vaddr & PAGE_FRAME) == as->as_vbase1) {
+		as->as_filevaddr1 = vaddr;
+		as->as_offset1 = offset;
+		as->as_filesize1 = filesize;
+	}
+	else if ((vaddr & PAGE_FRAME) == as->as_vbase2) {
+		as->as_filevaddr2 = vaddr;
+		as->as_offset2 = offset;
+		as->as_filesize2 = filesize;
+	}
+	else {
+		return EINVAL;
+	}
+
+	//the executable is kept open as long as the address space needs it
+	if (as->as_file == NULL) {
+		VOP_INCREF(v);
+		as->as_file = v;
+	}
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t oldtop = as->as_heaptop, newtop;
+
+	if (amount < 0 && (vaddr_t)-amount > oldtop - as->as_heapbase) {
+		return EINVAL;
+	}
+	if (amount > 0 &&
+	    (vaddr_t)amount > as->as_mmapbase - oldtop) {
+		return ENOMEM;
+	}
+	newtop = oldtop + amount;
+
+	/*
+	 * Growing just moves the break, the pages are zero-filled on
+	 * their first fault. The whole pages past a lower break go back
+	 * to the IPT and to the swap file right away.
+	 */
+	if (ROUNDUP(newtop, PAGE_SIZE) < ROUNDUP(oldtop, PAGE_SIZE)) {
+		spinlock_acquire(&vm_lock);
+		pages_release(IPT, ROUNDUP(newtop, PAGE_SIZE),
+			      ROUNDUP(oldtop, PAGE_SIZE));
+		chunks_release(ST, ROUNDUP(newtop, PAGE_SIZE),
+			       ROUNDUP(oldtop, PAGE_SIZE));
+		spinlock_release(&vm_lock);
+	}
+	as->as_heaptop = newtop;
+	*oldbreak = oldtop;
+	return 0;
+}
+
+/*
+ * Read the page at VADDR of the mapping MR. The part of the page past
+ * the end of the file is zero-filled.
+ */
+static
+bool
+mmap_load_page(struct mmap_region *mr, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  mr->mr_offset + (vaddr - mr->mr_start), UIO_READ);
+	result = VOP_READ(mr->mr_file, &ku);
+	if (result) {
+		panic("Failed loading page 0x%x from a mapped file\n", vaddr);
+	}
+	return true;
+}
+
+bool
+as_load_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t filevaddr, start, end;
+	off_t offset;
+	size_t filesize;
+	struct mmap_region *mr;
+	int result;
+
+	vaddr &= PAGE_FRAME;
+	mr = as_mmap_find(as, vaddr);
+	if (mr != NULL) {
+		return mmap_load_page(mr, vaddr, paddr);
+	}
+	if (as->as_file == NULL) {
+		return false;
+	}
+	if (vaddr >= as->as_vbase1 &&
+	    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+		filevaddr = as->as_filevaddr1;
+		offset = as->as_offset1;
+		filesize = as->as_filesize1;
+	}
+	else if (vaddr >= as->as_vbase2 &&
+		 vaddr < as->as_vbase2 + as->as_npages2 * PAGE_SIZE) {
+		filevaddr = as->as_filevaddr2;
+		offset = as->as_offset2;
+		filesize = as->as_filesize2;
+	}
+	else {
+		return false;
+	}
+
+	//part of the page backed by the file, the rest of it is bss
+	start = vaddr > filevaddr ? vaddr : filevaddr;
+	end = vaddr + PAGE_SIZE < filevaddr + filesize ?
+		vaddr + PAGE_SIZE : filevaddr + filesize;
+	if (start >= end) {
+		return false;
+	}
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + start - vaddr),
+		  end - start, offset + (start - filevaddr), UIO_READ);
+	result = VOP_READ(as->as_file, &ku);
+	if (result || ku.uio_resid != 0) {
+		panic("Failed loading page 0x%x from the executable\n", vaddr);
+	}
+	return true;
+}
+struct mmap_region *
+as_mmap_find(struct addrspace *as, vaddr_t vaddr)
+{
+	struct mmap_region *mr;
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (vaddr >= mr->mr_start &&
+		    vaddr < mr->mr_start + mr->mr_npages * PAGE_SIZE) {
+			return mr;
+		}
+	}
+	return NULL;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, int prot,
+	int flags, off_t offset, vaddr_t *ret)
+{
+	struct mmap_region *mr;
+	size_t npages;
+	vaddr_t heapend;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	/* the pages can always be read, there must be a way to access them */
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+	    (prot & (PROT_READ | PROT_WRITE)) == 0) {
+		return EINVAL;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	heapend = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+	if (len > as->as_mmapbase ||
+	    npages > (as->as_mmapbase - heapend) / PAGE_SIZE) {
+		return ENOMEM;
+	}
+
+	mr = kmalloc(sizeof(*mr));
+	if (mr == NULL) {
+		return ENOMEM;
+	}
+	mr->mr_start = as->as_mmapbase - npages * PAGE_SIZE;
+	mr->mr_npages = npages;
+	mr->mr_file = v;
+	mr->mr_offset = offset;
+	mr->mr_prot = prot;
+	mr->mr_flags = flags;
+	VOP_INCREF(v);
+
+	/* Nothing is read now, the pages fault in from the file */
+	mr->mr_next = as->as_mmaps;
+	as->as_mmaps = mr;
+	as->as_mmapbase = mr->mr_start;
+	*ret = mr->mr_start;
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	if (vaddr % PAGE_SIZE != 0 || vaddr + len < vaddr) {
+		return EINVAL;
+	}
+	if (as_mmap_find(as, vaddr) == NULL) {
+		return ENOMEM;
+	}
+	spinlock_acquire(&vm_lock);
+	pages_sync(IPT, vaddr, ROUNDUP(vaddr + len, PAGE_SIZE));
+	spinlock_release(&vm_lock);
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct mmap_region *mr, **prev;
+	vaddr_t end;
+
+	for (prev = &as->as_mmaps; *prev != NULL; prev = &(*prev)->mr_next) {
+		if ((*prev)->mr_start == vaddr) {
+			break;
+		}
+	}
+	mr = *prev;
+	if (mr == NULL ||
+	    ROUNDUP(len, PAGE_SIZE) != mr->mr_npages * PAGE_SIZE) {
+		return EINVAL;
+	}
+	end = vaddr + mr->mr_npages * PAGE_SIZE;
 
+	/*
+	 * The file gets the changes to the shared pages, then the frames
+	 * and the swap copies go away like those of the heap.
+	 */
+	spinlock_acquire(&vm_lock);
+	if (mr->mr_flags == MAP_SHARED) {
+		pages_sync(IPT, vaddr, end);
+	}
+	pages_release(IPT, vaddr, end);
+	chunks_release(ST, vaddr, end);
+	spinlock_release(&vm_lock);
+
+	*prev = mr->mr_next;
+	vfs_close(mr->mr_file);
+	kfree(mr);
+
+	/* The room below the stack left by the lowest mappings goes back to the heap */
+	as->as_mmapbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (mr->mr_start < as->as_mmapbase) {
+			as->as_mmapbase = mr->mr_start;
+		}
+	}
+	return 0;
+}
+
+void
+as_munmap_all(struct addrspace *as)
+{
+	while (as->as_mmaps != NULL) {
+		as_munmap(as, as->as_mmaps->mr_start,
+			  as->as_mmaps->mr_npages * PAGE_SIZE);
+	}
+}
+#endif
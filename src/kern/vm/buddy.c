@@ -0,0 +1,108 @@
+#include "buddy.h"
+#include <lib.h>
+
+//Orders go up to 2^(BUDDY_MAX_ORDER - 1) frames, more than the RAM System/161 can have
+#define BUDDY_MAX_ORDER 20
+
+struct buddy_frame{
+    int next, prev;             /*Free blocks of the same order, only for the first frame of a free block*/
+    int order;                  /*Order of the free block starting here, -1 if no free block starts here*/
+};
+
+struct buddy{
+    struct buddy_frame *frames;
+    uint32_t n_frames;
+    int free_head[BUDDY_MAX_ORDER];     /*First free block of each order, -1 if there is none*/
+};
+
+static void block_insert(buddy_allocator b, uint32_t first, uint32_t order){
+    b->frames[first].order = order;
+    b->frames[first].prev = -1;
+    b->frames[first].next = b->free_head[order];
+    if(b->free_head[order] != -1)
+        b->frames[b->free_head[order]].prev = first;
+    b->free_head[order] = first;
+}
+
+static void block_remove(buddy_allocator b, uint32_t first){
+    struct buddy_frame *f = &b->frames[first];
+
+    if(f->prev == -1)
+        b->free_head[f->order] = f->next;
+    else
+        b->frames[f->prev].next = f->next;
+    if(f->next != -1)
+        b->frames[f->next].prev = f->prev;
+    f->order = -1;
+}
+
+buddy_allocator buddyInit(uint32_t max_frames){
+    buddy_allocator b = kmalloc(sizeof(*b));
+    uint32_t i, order;
+
+    if(b == NULL)
+        panic("VM: Failed to create the buddy allocator\n");
+    b->frames = kmalloc(max_frames * sizeof(*(b->frames)));
+    if(b->frames == NULL)
+        panic("VM: Failed to create the buddy allocator\n");
+    b->n_frames = 0;
+    for(order = 0; order < BUDDY_MAX_ORDER; order++){
+        b->free_head[order] = -1;
+    }
+    for(i = 0; i < max_frames; i++){
+        b->frames[i].order = -1;
+    }
+    return b;
+}
+
+void buddy_add_frames(buddy_allocator b, uint32_t n_frames){
+    uint32_t i, order;
+
+    KASSERT(b->n_frames == 0);
+    b->n_frames = n_frames;
+    //cover the frames with the largest aligned blocks that fit
+    for(i = 0; i < n_frames; i += 1U << order){
+        for(order = 0; order + 1 < BUDDY_MAX_ORDER && i % (2U << order) == 0 && i + (2U << order) <= n_frames; order++);
+        block_insert(b, i, order);
+    }
+}
+
+uint32_t buddy_order(uint32_t npages){
+    uint32_t order;
+
+    for(order = 0; (1U << order) < npages; order++);
+    return order;
+}
+
+int buddy_alloc(buddy_allocator b, uint32_t order){
+    uint32_t o;
+    int first;
+
+    for(o = order; o < BUDDY_MAX_ORDER && b->free_head[o] == -1; o++);
+    if(o == BUDDY_MAX_ORDER)
+        return -1;
+    first = b->free_head[o];
+    block_remove(b, first);
+    //split the block, giving back the upper halves
+    while(o > order){
+        o--;
+        block_insert(b, first + (1U << o), o);
+    }
+    return first;
+}
+
+void buddy_free(buddy_allocator b, uint32_t first, uint32_t order){
+    uint32_t buddy;
+
+    KASSERT(first % (1U << order) == 0 && b->frames[first].order == -1);
+    //a free block of the same order in the other half is merged with this one
+    for(; order + 1 < BUDDY_MAX_ORDER; order++){
+        buddy = first ^ (1U << order);
+        if(buddy >= b->n_frames || b->frames[buddy].order != (int)order)
+            break;
+        block_remove(b, buddy);
+        if(buddy < first)
+            first = buddy;
+    }
+    block_insert(b, first, order);
+}
@@ -29,7 +29,10 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -121,6 +124,15 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts per-cpu magazines of free blocks in front of the
+ * pages (see below). GUARDS and LABELS set up every block they hand
+ * out, so they turn them off.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -160,14 +172,38 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their free lists. The magazines
+ * in front of them are per-cpu and take it only to move blocks in and
+ * out in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Block type + 1 of each page of the subpage allocator, 0 for the
+ * other pages, indexed by physical page number. It is written with
+ * kmalloc_spinlock held when a page joins or leaves the heap; the
+ * entry of the page of a block that is allocated cannot change, so
+ * kfree reads it without the lock. Like kheaproots below it is sized
+ * for the 16M of RAM of System/161; the pages past that are just not
+ * recorded, and their blocks skip the magazines.
+ */
+
+#define NUM_HEAPPAGES (16 * 1024 * 1024 / PAGE_SIZE)
+#define HEAPPAGE(addr) (((addr) - MIPS_KSEG0) / PAGE_SIZE)
+
+static uint8_t pageblocktypes[NUM_HEAPPAGES];
+
+static
+void
+setpageblocktype(vaddr_t prpage, unsigned value)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (HEAPPAGE(prpage) < NUM_HEAPPAGES) {
+		pageblocktypes[HEAPPAGE(prpage)] = value;
+	}
+}
+
 ////////////////////////////////////////
 
 /*
@@ -866,6 +902,43 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take the first block off the free list of the page PR, which has
+ * free blocks.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -921,25 +994,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -988,6 +1043,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	setpageblocktype(prpage, blktype + 1);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1018,15 +1074,18 @@ subpage_kmalloc(size_t sz
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put the block at PTRADDR (PTR as seen by the client) back on the
+ * free list of its page. If the page becomes wholly free, it is taken
+ * off the lists and *FREEPAGE is set to its address, for the caller
+ * to hand it to free_kpages once it has released kmalloc_spinlock;
+ * otherwise *FREEPAGE is 0. If the block is not on any heap page we
+ * recognize, return -1.
  */
 static
 int
-subpage_kfree(void *ptr)
+subpage_putblock(void *ptr, vaddr_t ptraddr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -1036,34 +1095,8 @@ subpage_kfree(void *ptr)
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	*freepage = 0;
 
 	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
 	prpage = 0;
@@ -1085,7 +1118,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -1142,12 +1174,59 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		setpageblocktype(prpage, 0);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// page to give back, if any
+	int result;
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	result = subpage_putblock(ptr, ptraddr, &freepage);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1156,9 +1235,187 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
-	return 0;
+	return result;
+}
+
+//
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Every cpu keeps a magazine of up to MAG_SIZE free blocks of each
+//    size, so that most kmalloc and kfree calls just take a block out
+//    of the magazine of their cpu or put one in, with interrupts off
+//    and without kmalloc_spinlock. An empty magazine is refilled with
+//    MAG_BATCH blocks taken off the pages in a single round of the
+//    lock, and a full one gives MAG_BATCH blocks back the same way.
+//
+//    As far as the pages are concerned, the blocks in the magazines
+//    are allocated: a page with blocks in a magazine stays in the heap.
+//
+
+#ifdef MAGAZINES
+
+#define MAG_MAXCPUS 32		/* System/161 has at most 32 cpus */
+#define MAG_SIZE 16
+#define MAG_BATCH 8
+
+struct magazine {
+	unsigned nblocks;
+	void *blocks[MAG_SIZE];
+};
+
+static struct magazine magazines[MAG_MAXCPUS][NSIZES];
+
+/*
+ * Take up to N free blocks of type BLKTYPE off the pages, into BLOCKS.
+ * Return how many there were: no new page is allocated.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	unsigned got = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_takeblock(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Give the N blocks in BLOCKS back to their pages.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_BATCH];
+	unsigned i, nfreepages = 0;
+	int result;
+
+	KASSERT(n <= MAG_BATCH);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<n; i++) {
+		result = subpage_putblock(blocks[i], (vaddr_t)blocks[i],
+					  &freepages[nfreepages]);
+		KASSERT(result == 0);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
 }
 
+/*
+ * Take a block of type BLKTYPE from the magazine of this cpu, refilling
+ * it if it is empty. NULL if there are no free blocks of that size on
+ * the pages either.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct magazine *mag;
+	void *ptr = NULL;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* early in boot, before the cpus are set up */
+		return NULL;
+	}
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAG_MAXCPUS);
+	mag = &magazines[curcpu->c_number][blktype];
+	if (mag->nblocks == 0) {
+		mag->nblocks = subpage_getblocks(blktype, mag->blocks,
+						 MAG_BATCH);
+	}
+	if (mag->nblocks > 0) {
+		ptr = mag->blocks[--mag->nblocks];
+	}
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Put PTR in the magazine of this cpu. False if it is not a block of
+ * the subpage allocator.
+ */
+static
+bool
+magazine_free(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	void *flush[MAG_BATCH];
+	struct magazine *mag;
+	unsigned blktype, i, nflush = 0;
+	int spl;
+
+	if (!CURCPU_EXISTS() || HEAPPAGE(ptraddr) >= NUM_HEAPPAGES ||
+	    pageblocktypes[HEAPPAGE(ptraddr)] == 0) {
+		return false;
+	}
+	blktype = pageblocktypes[HEAPPAGE(ptraddr)] - 1;
+
+	/* Check for proper positioning and alignment */
+	if (ptraddr % PAGE_SIZE % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	KASSERT(curcpu->c_number < MAG_MAXCPUS);
+	mag = &magazines[curcpu->c_number][blktype];
+
+	/* this block should not already be in the magazine! */
+#ifdef SLOW
+	for (i=0; i<mag->nblocks; i++) {
+		KASSERT(mag->blocks[i] != ptr);
+	}
+#else
+	/* check just the top */
+	KASSERT(mag->nblocks == 0 || mag->blocks[mag->nblocks - 1] != ptr);
+#endif
+	if (mag->nblocks == MAG_SIZE) {
+		/* the oldest blocks go back, the ones freed last stay */
+		for (i=0; i<MAG_BATCH; i++) {
+			flush[i] = mag->blocks[i];
+		}
+		for (i=MAG_BATCH; i<MAG_SIZE; i++) {
+			mag->blocks[i - MAG_BATCH] = mag->blocks[i];
+		}
+		mag->nblocks -= MAG_BATCH;
+		nflush = MAG_BATCH;
+	}
+	mag->blocks[mag->nblocks++] = ptr;
+	splx(spl);
+
+	/* Give the blocks back with interrupts on. */
+	if (nflush > 0) {
+		subpage_putblocks(flush, nflush);
+	}
+	return true;
+}
+
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1201,6 +1458,15 @@ kmalloc(size_t sz)
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
+#ifdef MAGAZINES
+	{
+		void *ptr = magazine_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+	/* no free block of that size: get a fresh page */
 	return subpage_kmalloc(sz);
 #endif
 }
@@ -1212,11 +1478,18 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try the magazines and then subpage; if that fails, assume it's
+	 * a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (magazine_free(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
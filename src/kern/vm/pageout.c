@@ -0,0 +1,64 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <pt.h>
+#include <vmstats.h>
+
+#if PAGEOUT_DAEMON
+
+static struct wchan *pageout_wchan;
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+
+//Keep the free frames between the low and the high watermark, so that faults rarely have to evict synchronously
+static void pageout_thread(void *data1, unsigned long data2){
+    uint32_t i;
+    bool freed = true;
+
+    (void)data1;
+    (void)data2;
+    for(;;){
+        spinlock_acquire(&pageout_lock);
+        //if the last batch freed nothing (all kernel or shared frames), wait for the next wake up anyway
+        while(!freed || get_n_free_frames(IPT) >= PAGEOUT_LOW_WATERMARK){
+            wchan_sleep(pageout_wchan, &pageout_lock);
+            freed = true;
+        }
+        spinlock_release(&pageout_lock);
+        /*statistics*/add_PAGEOUT_wakeup();
+
+        freed = false;
+        spinlock_acquire(&vm_lock);
+        for(i = 0; i < PAGEOUT_BATCH && get_n_free_frames(IPT) < PAGEOUT_HIGH_WATERMARK; i++){
+            if(pageout_frame(IPT, ST)){
+                freed = true;
+                /*statistics*/add_PAGEOUT_free();
+            }
+        }
+        spinlock_release(&vm_lock);
+    }
+}
+
+void pageout_bootstrap(void){
+    int result;
+
+    pageout_wchan = wchan_create("pageout");
+    if(pageout_wchan == NULL)
+        panic("VM: Failed to create the pageout wchan\n");
+    result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+    if(result)
+        panic("VM: Failed to start the pageout daemon: %s\n", strerror(result));
+}
+
+void pageout_wakeup(void){
+    //faults can happen before the daemon is started
+    if(pageout_wchan == NULL)
+        return;
+    spinlock_acquire(&pageout_lock);
+    wchan_wakeone(pageout_wchan, &pageout_lock);
+    spinlock_release(&pageout_lock);
+}
+
+#endif
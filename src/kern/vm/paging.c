@@ -33,6 +33,7 @@
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <wchan.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
@@ -45,6 +46,7 @@
 #include "vm_tlb.h"
 #include <syscall.h>
 #include <vmstats.h>
+#include <kern/mman.h>
 
 /* under dumbvm, always have 72k of user stack */
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
@@ -59,29 +61,11 @@ void
 vm_bootstrap(void)
 {
 	vm_enabled = 0;
-	uint32_t i;
 	spinlock_init(&vm_lock);
-	spinlock_init(&k_lock);
-
-	k_frames = kmalloc(MAX_PROCESSES * sizeof(*k_frames));
-	for(i = 0; i < MAX_PROCESSES; i++){
-		if(i == 0){
-			k_frames[i].prev = -1;
-			k_frames[i].next = 1;
-		}else if(i == MAX_PROCESSES - 1){
-			k_frames[i].next = -1;
-			k_frames[i].prev = i - 1;
-		}else{
-			k_frames[i].prev = i - 1;
-			k_frames[i].next = i + 1;
-		}
-		k_frames[i].owner = 0;
-		k_frames[i].n_pages = 0;
-		k_frames[i].start_frame_n_to_remove = 0;
-		k_frames[i].vaddr_to_free = 0;
-	}
-	start_index_k = -1;
-	start_free_index = 0;
+	vm_wchan = wchan_create("vm");
+	if(vm_wchan == NULL)
+		panic("VM: Failed to create the vm wchan\n");
+
 	// Swap area init
 	char swap_file_name[] = "lhd0raw:";
 	ST = swapTableInit(swap_file_name);
@@ -97,6 +81,9 @@ vm_bootstrap(void)
 	vm_enabled = 1;
 	/* Now we can start keeping track of VM stats */
 	stat_bootstrap();
+#if PAGEOUT_DAEMON
+	pageout_bootstrap();
+#endif
 }
 
 static
@@ -117,11 +104,12 @@ getppages(unsigned long npages)
 vaddr_t
 alloc_kpages(unsigned npages)
 {
-	int spl = splhigh();
 	paddr_t pa;
 	if(vm_enabled) {
 		//alloc n contiguous pages
+		spinlock_acquire(&vm_lock);
 		pa = alloc_n_contiguos_pages(npages, IPT);
+		spinlock_release(&vm_lock);
 	}else{
 		pa = getppages(npages);
 		if (pa==0) {
@@ -129,59 +117,94 @@ alloc_kpages(unsigned npages)
 		}
 
 	}
-	splx(spl);
 	return PADDR_TO_KVADDR(pa);
 }
 
 void
 free_kpages(vaddr_t addr)
 {
-	int frame_n, i;
-	uint32_t j;
-	int spl = splhigh();
-	if(vm_enabled) {
-		spinlock_acquire(&k_lock);
-
-		addr &= PAGE_FRAME;
-		for(i = start_index_k; i != -1 && k_frames[i].vaddr_to_free != addr; i = k_frames[i].next);
-		if(i == -1)
-			panic("Where is that frame?!\n");
-		for(frame_n = k_frames[i].start_frame_n_to_remove, j = 0; j < k_frames[i].n_pages; frame_n++, j++){
-			remove_page(IPT, frame_n);
-		}
-		frame_n_k += k_frames[i].n_pages;
-		if(i == start_index_k){
-			start_index_k = k_frames[i].next;
-			if(start_index_k != -1)
-				k_frames[start_index_k].prev = -1;
-		}else{
-			k_frames[k_frames[i].prev].next = k_frames[i].next;
-			if(k_frames[i].next != -1)
-				k_frames[k_frames[i].next].prev = k_frames[i].prev;
-		}
-		k_frames[start_free_index].prev = i;
-		k_frames[i].next = start_free_index;
-		k_frames[i].prev = -1;
-		start_free_index = i;
-		spinlock_release(&k_lock);
+	paddr_t pa = (addr & PAGE_FRAME) - MIPS_KSEG0;
+
+	if(vm_enabled && pa >= get_mem_base_addr(IPT)) {
+		spinlock_acquire(&vm_lock);
+		free_n_contiguos_pages(pa, IPT);
+		spinlock_release(&vm_lock);
 	}else{
+		/* pages stolen before the VM system was up are not in the IPT */
 		/* nothing - leak the memory. */
 	}
-	splx(spl);
 }
 
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_shutdown(void) 
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	print_stats();
 }
 
+/* True if vaddr is in a file mapping without PROT_WRITE */
+static
+int
+is_readonly_mapping(vaddr_t vaddr)
+{
+	struct addrspace *as = proc_getas();
+	struct mmap_region *mr;
+
+	if (as == NULL) {
+		return 0;
+	}
+	mr = as_mmap_find(as, vaddr);
+	return mr != NULL && !(mr->mr_prot & PROT_WRITE);
+}
+
+#if FAULTAROUND_MAX_WINDOW > 0
+/*
+ * Fault-around: after a TLB miss, load the translations of the resident
+ * pages following faultaddress as well, in free TLB slots only. The
+ * translations preloaded were used if the next miss of the process is
+ * on the page right after them: the window doubles while the misses
+ * are sequential like that, and halves on any other miss.
+ */
+static
 void
-vm_shutdown(void) 
+fault_around(vaddr_t faultaddress)
 {
-	print_stats();
+	struct proc *p = curproc;
+	vaddr_t vaddr;
+	int paddr;
+	uint32_t n;
+
+	if (faultaddress == p->fa_next) {
+		/* statistics */ add_TLB_preload_used(p->fa_pending);
+		p->fa_window = p->fa_window == 0 ? 1 : p->fa_window * 2;
+		if (p->fa_window > FAULTAROUND_MAX_WINDOW) {
+			p->fa_window = FAULTAROUND_MAX_WINDOW;
+		}
+	}
+	else {
+		/* statistics */ add_TLB_preload_wasted(p->fa_pending);
+		p->fa_window /= 2;
+	}
+
+	/* Stop at the first page that is not resident: the walk faults there anyway */
+	vaddr = faultaddress + PAGE_SIZE;
+	for (n = 0; n < p->fa_window && vaddr < MIPS_KSEG0; n++) {
+		paddr = getFrameAddress(IPT, vaddr >> 12, false);
+		if (paddr == -1 || !is_page_preloadable(IPT, paddr)) {
+			break;
+		}
+		set_page_cached(IPT, paddr);
+		/* a dirty page of a shared file may be mapped read-only here */
+		if (!TLB_Preload(vaddr, paddr, is_page_writable(IPT, paddr) &&
+				 !is_readonly_mapping(vaddr))) {
+			break;
+		}
+		vaddr += PAGE_SIZE;
+	}
+	p->fa_next = vaddr;
+	p->fa_pending = n;
+	/* statistics */ add_TLB_preload(n);
 }
+#endif
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
@@ -190,7 +213,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int paddr;
 	//uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -199,15 +221,22 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 			//try to access a read-only segment causes a fault, terminate the process
-			kprintf("\nWrite attempt on read-only code segment!\nI think I'll end the process...\n");
-			sys__exit(0);
+			if(is_code_segment(faultaddress)){
+				kprintf("\nWrite attempt on read-only code segment!\nI think I'll end the process...\n");
+				sys__exit(0);
+			}
+			//otherwise it is the first write to a clean page
+			/* fall through */
+	    case VM_FAULT_WRITE:
+			//so does a write to a file mapped read-only
+			if(is_readonly_mapping(faultaddress)){
+				kprintf("\nWrite attempt on read-only file mapping!\nI think I'll end the process...\n");
+				sys__exit(0);
+			}
 			break;
 	    case VM_FAULT_READ:
 			
 			break;
-	    case VM_FAULT_WRITE:
-		
-		break;
 	    default:
 		return EINVAL;
 	}
@@ -267,13 +296,31 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* make sure it's page-aligned */
 	//KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-	//spinlock_acquire(&vm_lock);
+	/*
+	 * vm_lock also keeps interrupts off on this CPU while frobbing the
+	 * TLB. It is released during the swap and ELF I/O, so faults on
+	 * other pages go on in the meantime.
+	 */
+	spinlock_acquire(&vm_lock);
 	if(faultaddress <= MIPS_KSEG0) {
+		//a process swapped out by the load control gets no frames until it is let back in
+		ws_wait_active(IPT);
+		//retrieve the frame number in the page table, waiting for it if it is in transit
+		while((paddr = getFrameAddress(IPT,(faultaddress & PAGE_FRAME) >> 12, false)) != -1 &&
+			is_page_busy(IPT, paddr)){
+			/* statistics */ add_VM_busy_wait();
+			wchan_sleep(vm_wchan, &vm_lock);
+		}
+		if(faulttype == VM_FAULT_READONLY && paddr != -1){
+			/* The page is resident and mapped read-only: mark it dirty and make the translation writable */
+			paddr = page_unshare(IPT, faultaddress, paddr & PAGE_FRAME, ST);
+			set_page_dirty(IPT, paddr);
+			set_page_cached(IPT, paddr);
+			TLB_Insert(faultaddress, paddr & PAGE_FRAME, true);
+			spinlock_release(&vm_lock);
+			return 0;
+		}
 		/* statistics */ add_TLB_fault();
-		//retrieve the frame number in the page table
-		paddr = getFrameAddress(IPT,(faultaddress & PAGE_FRAME) >> 12, false);
 		if(paddr==-1){
 			//PAGE FAULT
 			/* Page was not already in memory, we need to handle page fault */
@@ -281,17 +328,25 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		} else {
 			/* Page is already in memory, we just need to reload the entry in the TLB */
 			/* statistics */ add_TLB_reload();
+			set_page_referenced(IPT, paddr);
 		}
 		paddr = paddr & PAGE_FRAME;
-		TLB_Insert(faultaddress,paddr);
+		//a write miss would fault again right away on a read-only translation, so mark the page dirty now
+		if(faulttype != VM_FAULT_READ && !is_code_segment(faultaddress)){
+			paddr = page_unshare(IPT, faultaddress, paddr, ST);
+			set_page_dirty(IPT, paddr);
+		}
+		set_page_cached(IPT, paddr);
+		//the frame of a shared file may be dirty through a writable mapping of another process, not of this one
+		TLB_Insert(faultaddress, paddr, is_page_writable(IPT, paddr) && !is_readonly_mapping(faultaddress));
+#if FAULTAROUND_MAX_WINDOW > 0
+		fault_around(faultaddress);
+#endif
 		//add to tlb
-		splx(spl);
-		//spinlock_release(&vm_lock);
+		spinlock_release(&vm_lock);
 		return 0;
 	}
-	splx(spl);
 	spinlock_release(&vm_lock);
-	//spinlock_release(&vm_lock);
 	return EFAULT;
 }
 
@@ -4,16 +4,32 @@
 #include <proc.h>
 #include <vm.h>
 #include <vmstats.h>
+#include <vm_tlb.h>
+#include <mainbus.h>
+#include <addrspace.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <clock.h>
+#include <uio.h>
+#include <vnode.h>
+#include <stat.h>
+#include <kern/mman.h>
+#include "buddy.h"
 
 // V = validity bit
 // C = chain bit (if next field has a valid value)
 // K = kernel bit (if the frame has been occupied by the kernel)
+// R = reference bit (if the page has been accessed since the clock hand last passed it)
+// D = dirty bit (if the page has been written since it was loaded, so its swap copy is stale)
+// B = busy bit (if the frame is in transit: being read, written to the swap file or copied, vm_lock released)
+// A = read-ahead bit (if the page was read from the swap file ahead of a fault and has not been accessed yet)
 //<----------------20------------>|<----6-----><----6---->|
 //_________________________________________________________
-//|       Virtual Page Number     |                 |K|C|V|  hi
+//|       Virtual Page Number     |          A|B|D|R|K|C|V|  hi
 //|_______________________________|_______________________|
-//|       Next                    |           |    PID    |  low
+//|       Next                    |                       |  low
 //|_______________________________|_______________________|
+//The owner of the frame is in its own field: pids go up to PID_MAX, they don't fit in the low bits
 
 #define IS_VALID(x) ((x) & 0x00000001)
 #define SET_VALID(x, value) (((x) &~ 0x00000001) | value)
@@ -21,20 +37,56 @@
 #define GET_PN(entry) ((entry &~ 0x00000FFF) >> 12)
 #define SET_NEXT(entry, next) ((entry & 0x00000FFF) | (next << 12))
 #define GET_NEXT(entry) ((entry &~ 0x00000FFF) >> 12)
-#define SET_PID(entry, pid) ((entry &~ 0x0000003F) | pid)
-#define GET_PID(entry) (entry & 0x0000003F)
 #define HAS_CHAIN(x) ((x) & 0x00000002)
 #define SET_CHAIN(x, value) (((x) &~ 0x00000002) | (value << 1))
 #define IS_KERNEL(x) ((x) & 0x00000004)
 #define SET_KERNEL(x, value) (((x) &~ 0x00000004) | (value << 2))
+#define IS_REFERENCED(x) ((x) & 0x00000008)
+#define SET_REFERENCED(x, value) (((x) &~ 0x00000008) | (value << 3))
+#define IS_DIRTY(x) ((x) & 0x00000010)
+#define SET_DIRTY(x, value) (((x) &~ 0x00000010) | (value << 4))
+#define IS_BUSY(x) ((x) & 0x00000020)
+#define SET_BUSY(x, value) (((x) &~ 0x00000020) | (value << 5))
+#define IS_READAHEAD(x) ((x) & 0x00000040)
+#define SET_READAHEAD(x, value) (((x) &~ 0x00000040) | (value << 6))
 #define IS_FULL(pt) (pt->first_free_frame == pt->last_free_frame && IS_VALID(pt->entries[pt->first_free_frame].hi))
+//Hash anchor table bucket for the couple (pid, page number), size must be a power of two
+#define HASH_IPT(pt, pid, pn) ((((pn) * 2654435761U) ^ (pid)) & ((pt)->hash_size - 1))
+//Page cache bucket for the couple (file, page)
+#define HASH_FILE(pt, file, page) ((((page) * 2654435761U) ^ ((uint32_t)(file) >> 4)) & ((pt)->hash_size - 1))
+//Text pages are cached by virtual page number, with this bit set not to collide with the pages of the file
+#define FILE_PAGE_TEXT 0x80000000
+//Page of a file mapped MAP_SHARED: the file gets its changes instead of the swap file
+#define IS_MAPPED_FILE(pt, frame_n) ((pt)->entries[frame_n].file != NULL && !((pt)->entries[frame_n].file_page & FILE_PAGE_TEXT))
 
-#define FIFO_RA 1
-#define RAND_RA 0
-#define RA FIFO_RA
+//Number of copy-on-write mappings that can be shared, per frame
+#define COW_ALIASES_PER_FRAME 2
 
 struct PTE{
     uint32_t hi, low;
+    uint16_t owner;             /*Pid of the process owning the frame, 0 if free*/
+    int prev;                   /*Previous frame in the frames list of the owner or in the free list, -1 for the first one*/
+    int hash_next;              /*Next frame in the same hash bucket, -1 if it is the last one*/
+    uint32_t refcount;          /*Number of address spaces mapping the frame: the owner plus its aliases*/
+    int alias_head;             /*First alias of the frame, -1 if the frame is not shared*/
+    uint32_t tlb_cpus;          /*CPUs that may have a translation of the frame in their TLB*/
+    struct vnode *file;         /*File whose page the frame holds, shared by the processes mapping it: the text of an
+                                  executable or a MAP_SHARED mapping; NULL if none*/
+    uint32_t file_page;         /*Page number in the file, or virtual page number | FILE_PAGE_TEXT for text*/
+    int file_next;              /*Next frame in the same page cache bucket*/
+#if RA == FIFO_RA
+    int fifo_next, fifo_prev;   /*Neighbours in the FIFO queue, newer and older, -1 at the ends*/
+#endif
+};
+
+//Mapping of a frame shared copy-on-write into the address space of a process other than its owner
+struct alias{
+    uint32_t pn;                /*Virtual page number*/
+    pid_t pid;                  /*Process sharing the frame*/
+    int frame;                  /*Frame shared, -1 if the alias is free*/
+    int hash_next;              /*Next entry in the same hash bucket*/
+    int frame_next;             /*Next alias of the same frame (next free alias for free ones)*/
+    int proc_next;              /*Next alias of the same process*/
 };
 
 struct pT{
@@ -46,34 +98,401 @@ struct pT{
     uint32_t first_free_frame;
     uint32_t last_free_frame;
     paddr_t mem_base_addr;      /*Used to keep track of the last address occupied by the kernel before the VM system was active*/
-    uint32_t *FIFO;             /*FIFO*/
-    uint32_t FIFO_index_start;  /*Index used to keep track of the last inserted element*/
-    uint32_t FIFO_index_last;   /*Index used to keep track of the first element which has been inserted*/
+#if RA == FIFO_RA
+    //the user frames in use, from the oldest loaded to the newest, linked through the entries
+    int fifo_head;              /*Oldest frame, -1 if the queue is empty*/
+    int fifo_tail;              /*Newest frame, -1 if the queue is empty*/
+#endif
+    uint32_t clock_hand;        /*Next frame the clock algorithm is going to look at*/
+    int *hash_anchor;           /*Hash anchor table: first frame of each (pid, page number) bucket, -1 if empty*/
+    int *file_anchor;           /*Page cache: first frame of each (file, page) bucket, -1 if empty*/
+    uint32_t hash_size;         /*Number of buckets of the hash anchor table*/
+    uint32_t n_free_frames;     /*Length of the free frames list*/
+    struct alias *aliases;      /*Pool of copy-on-write mappings*/
+    uint32_t n_aliases;
+    int first_free_alias;       /*Head of the free aliases list, -1 if there are none left*/
+    buddy_allocator kernel_buddy;   /*Blocks of frames reserved to the kernel multi-page allocations*/
+    uint32_t *kernel_npages;    /*Pages of the kernel allocation starting at each frame, 0 if none starts there*/
+    uint32_t n_kernel_frames;   /*Frames taken by the kernel multi-page allocations*/
+    uint32_t ws_total;          /*Sum of the resident set targets of the processes not swapped out by the load control*/
+    uint32_t ws_nactive;        /*Number of those processes*/
 };
 
+//The hash buckets link both frames and aliases:
+//indexes lower than the IPT size are frame numbers, the others are alias indexes + IPT size
+static int *hash_next_of(page_table pt, int i){
+    if((uint32_t)i < pt->size)
+        return &pt->entries[i].hash_next;
+    return &pt->aliases[i - pt->size].hash_next;
+}
+
+static void hash_link(page_table pt, uint32_t bucket, int i){
+    //insertion in head, the bucket order does not matter
+    *hash_next_of(pt, i) = pt->hash_anchor[bucket];
+    pt->hash_anchor[bucket] = i;
+}
+
+static void hash_unlink(page_table pt, uint32_t bucket, int index){
+    int i;
+    if(pt->hash_anchor[bucket] == index){
+        pt->hash_anchor[bucket] = *hash_next_of(pt, index);
+    }else{
+        for(i = pt->hash_anchor[bucket]; i != -1 && *hash_next_of(pt, i) != index; i = *hash_next_of(pt, i));
+        if(i == -1)
+            panic("Entry %d is not in its hash bucket!\n", index);
+        *hash_next_of(pt, i) = *hash_next_of(pt, index);
+    }
+    *hash_next_of(pt, index) = -1;
+}
+
+static void hash_insert(page_table pt, uint32_t index){
+    hash_link(pt, HASH_IPT(pt, pt->entries[index].owner, GET_PN(pt->entries[index].hi)), index);
+}
+
+static void hash_remove(page_table pt, uint32_t index){
+    hash_unlink(pt, HASH_IPT(pt, pt->entries[index].owner, GET_PN(pt->entries[index].hi)), index);
+}
+
+//The frames lists (the one of each process and the free one) are linked both ways: next and chain bit in the entry,
+//prev in its own field, so that a frame leaves its list in constant time
+
+//Append the frame to the list going from *head to *tail, empty if it has no frames yet
+static void frame_list_append(page_table pt, uint32_t *head, uint32_t *tail, bool empty, uint32_t index){
+    pt->entries[index].hi = SET_CHAIN(pt->entries[index].hi, 0);
+    pt->entries[index].low = SET_NEXT(pt->entries[index].low, 0);
+    if(empty){
+        //we need to update also the head of the chain
+        *head = index;
+        pt->entries[index].prev = -1;
+    }else{
+        //the penultimate frame of the chain is updated
+        //the chain is updated and the next field is updated indexing the last frame
+        pt->entries[*tail].hi = SET_CHAIN(pt->entries[*tail].hi, 1);
+        pt->entries[*tail].low = SET_NEXT(pt->entries[*tail].low, index);
+        pt->entries[index].prev = *tail;
+    }
+    *tail = index;
+}
+
+//Unlink the frame from the list going from *head to *tail, which holds other frames too
+static void frame_list_unlink(page_table pt, uint32_t *head, uint32_t *tail, uint32_t index){
+    int prev = pt->entries[index].prev;
+    uint32_t next = GET_NEXT(pt->entries[index].low);
+
+    if(index == *head){
+        *head = next;
+        pt->entries[next].prev = -1;
+    }else if(prev == -1){
+        panic("Are we trying to remove frame %d from a list it does not belong to?\n", index);
+    }else if(index == *tail){
+        *tail = prev;
+        pt->entries[prev].hi = SET_CHAIN(pt->entries[prev].hi, 0);
+    }else{
+        pt->entries[prev].low = SET_NEXT(pt->entries[prev].low, next);
+        pt->entries[next].prev = prev;
+    }
+    pt->entries[index].prev = -1;
+}
+
+#if RA == FIFO_RA
+//Append the frame to the FIFO queue, as the newest one
+static void fifo_append(page_table pt, uint32_t frame_n){
+    pt->entries[frame_n].fifo_next = -1;
+    pt->entries[frame_n].fifo_prev = pt->fifo_tail;
+    if(pt->fifo_tail == -1)
+        pt->fifo_head = frame_n;
+    else
+        pt->entries[pt->fifo_tail].fifo_next = frame_n;
+    pt->fifo_tail = frame_n;
+}
+
+//Remove the frame from the FIFO queue
+static void fifo_unlink(page_table pt, uint32_t frame_n){
+    int prev = pt->entries[frame_n].fifo_prev, next = pt->entries[frame_n].fifo_next;
+
+    if(prev == -1)
+        pt->fifo_head = next;
+    else
+        pt->entries[prev].fifo_next = next;
+    if(next == -1)
+        pt->fifo_tail = prev;
+    else
+        pt->entries[next].fifo_prev = prev;
+}
+#endif
+
+//Append the frame to the frames list of process p
+static void proc_frames_append(page_table pt, struct proc *p, uint32_t index){
+    frame_list_append(pt, &p->start_pt_i, &p->last_pt_i, p->n_frames == 0, index);
+    p->n_frames++;
+}
+
+//Remove the frame from the frames list of process p
+static void proc_frames_remove(page_table pt, struct proc *p, uint32_t frame_n){
+    if(p->n_frames != 1){
+        frame_list_unlink(pt, &p->start_pt_i, &p->last_pt_i, frame_n);
+    }else{
+        p->last_pt_i = p->start_pt_i;
+    }
+    p->n_frames--;
+}
+
+//Map frame_n copy-on-write also in the address space of p, return false if there are no free aliases left
+static bool alias_add(page_table pt, uint32_t frame_n, struct proc *p, uint32_t page_n){
+    int a = pt->first_free_alias;
+    if(a == -1)
+        return false;
+    pt->first_free_alias = pt->aliases[a].frame_next;
+
+    pt->aliases[a].pn = page_n;
+    pt->aliases[a].pid = p->p_pid;
+    pt->aliases[a].frame = frame_n;
+    pt->aliases[a].frame_next = pt->entries[frame_n].alias_head;
+    pt->entries[frame_n].alias_head = a;
+    pt->aliases[a].proc_next = p->start_alias_i;
+    p->start_alias_i = a;
+    hash_link(pt, HASH_IPT(pt, p->p_pid, page_n), pt->size + a);
+    pt->entries[frame_n].refcount++;
+    if(pt->entries[frame_n].file != NULL && (pt->entries[frame_n].file_page & FILE_PAGE_TEXT)){
+        /*statistics*/add_TEXT_saved(1);
+    }
+    return true;
+}
+
+//Remove the alias a of process p
+static void alias_remove(page_table pt, int a, struct proc *p){
+    struct alias *al = &pt->aliases[a];
+    int i;
+
+    hash_unlink(pt, HASH_IPT(pt, al->pid, al->pn), pt->size + a);
+    if(pt->entries[al->frame].alias_head == a){
+        pt->entries[al->frame].alias_head = al->frame_next;
+    }else{
+        for(i = pt->entries[al->frame].alias_head; pt->aliases[i].frame_next != a; i = pt->aliases[i].frame_next);
+        pt->aliases[i].frame_next = al->frame_next;
+    }
+    if(p->start_alias_i == a){
+        p->start_alias_i = al->proc_next;
+    }else{
+        for(i = p->start_alias_i; pt->aliases[i].proc_next != a; i = pt->aliases[i].proc_next);
+        pt->aliases[i].proc_next = al->proc_next;
+    }
+    pt->entries[al->frame].refcount--;
+    if(pt->entries[al->frame].file != NULL && (pt->entries[al->frame].file_page & FILE_PAGE_TEXT)){
+        /*statistics*/add_TEXT_saved(-1);
+    }
+
+    al->frame = -1;
+    al->frame_next = pt->first_free_alias;
+    pt->first_free_alias = a;
+}
+
+//The owner of a shared frame does not map it anymore: the first process sharing it becomes the new owner
+static void frame_give_away(page_table pt, uint32_t frame_n, struct proc *owner){
+    int a = pt->entries[frame_n].alias_head;
+    struct proc *p = proc_search_pid(pt->aliases[a].pid);
+
+    alias_remove(pt, a, p);
+    hash_remove(pt, frame_n);
+    proc_frames_remove(pt, owner, frame_n);
+    pt->entries[frame_n].owner = p->p_pid;
+    //the new owner has no copy of the page in the swap file, unless it is a page of a file: it is read from it again
+    if(pt->entries[frame_n].file == NULL)
+        pt->entries[frame_n].hi = SET_DIRTY(pt->entries[frame_n].hi, 1);
+    hash_insert(pt, frame_n);
+    proc_frames_append(pt, p, frame_n);
+}
+
+//Page cache of the files. A frame stays in it as long as it is valid: it is always mapped by a process that has the
+//file open (as executable or mapping), so the vnode is kept open by that address space
+static void file_insert(page_table pt, uint32_t frame_n, struct vnode *file, uint32_t file_page){
+    uint32_t bucket = HASH_FILE(pt, file, file_page);
+
+    pt->entries[frame_n].file = file;
+    pt->entries[frame_n].file_page = file_page;
+    pt->entries[frame_n].file_next = pt->file_anchor[bucket];
+    pt->file_anchor[bucket] = frame_n;
+}
+
+static void file_remove(page_table pt, uint32_t frame_n){
+    int *link = &pt->file_anchor[HASH_FILE(pt, pt->entries[frame_n].file, pt->entries[frame_n].file_page)];
+
+    for(; *link != (int)frame_n; link = &pt->entries[*link].file_next){
+        if(*link == -1)
+            panic("Frame %u is not in its page cache bucket!\n", frame_n);
+    }
+    *link = pt->entries[frame_n].file_next;
+    pt->entries[frame_n].file = NULL;
+}
+
+//Frame holding the page file_page of file, -1 if there is none
+static int file_lookup(page_table pt, struct vnode *file, uint32_t file_page){
+    int i;
+
+    for(i = pt->file_anchor[HASH_FILE(pt, file, file_page)]; i != -1; i = pt->entries[i].file_next){
+        if(pt->entries[i].file == file && pt->entries[i].file_page == file_page)
+            return i;
+    }
+    return -1;
+}
+
+//File whose page the current process maps at vaddr, the same for all the processes mapping it, and the page in it:
+//the text segment, read-only, or a MAP_SHARED mapping. NULL otherwise: the other pages are private to the process
+static struct vnode *file_of(vaddr_t vaddr, uint32_t *file_page){
+    struct addrspace *as = proc_getas();
+    struct mmap_region *mr;
+
+    if(as == NULL)
+        return NULL;
+    if(as->as_file != NULL && vaddr >= as->as_vbase1 && vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE){
+        *file_page = (vaddr >> 12) | FILE_PAGE_TEXT;
+        return as->as_file;
+    }
+    mr = as_mmap_find(as, vaddr);
+    if(mr == NULL || mr->mr_flags != MAP_SHARED)
+        return NULL;
+    *file_page = (mr->mr_offset + ((vaddr & PAGE_FRAME) - mr->mr_start)) / PAGE_SIZE;
+    return mr->mr_file;
+}
+
+//Write the page held by the busy frame back to its mapped file, vm_lock is released meanwhile. The part of the page
+//past the end of the file is not written: mappings don't grow files.
+//The vnode can't go away: it is mapped by the owner of the frame, whose munmap waits for the frame
+static void file_writeback(page_table pt, uint32_t frame_n){
+    struct vnode *file = pt->entries[frame_n].file;
+    off_t offset = (off_t)pt->entries[frame_n].file_page * PAGE_SIZE;
+    void *kvaddr = (void *)PADDR_TO_KVADDR(frame_n * PAGE_SIZE + pt->mem_base_addr);
+    struct stat st;
+    struct iovec iov;
+    struct uio ku;
+    size_t len;
+    int result;
+
+    KASSERT(IS_BUSY(pt->entries[frame_n].hi));
+    //no one can write to the page while it is busy, it is clean once written
+    pt->entries[frame_n].hi = SET_DIRTY(pt->entries[frame_n].hi, 0);
+    spinlock_release(&vm_lock);
+    result = VOP_STAT(file, &st);
+    if(!result && st.st_size > offset){
+        len = st.st_size - offset < PAGE_SIZE ? st.st_size - offset : PAGE_SIZE;
+        uio_kinit(&iov, &ku, kvaddr, len, offset, UIO_WRITE);
+        result = VOP_WRITE(file, &ku);
+    }
+    if(result)
+        kprintf("VM: Failed writing back a page of a mapped file: %s\n", strerror(result));
+    spinlock_acquire(&vm_lock);
+    /*statistics*/add_MMAP_writeback();
+}
+
+//A kernel page allocated by a process that is exiting: it stays allocated, owned by the kernel process
+static void frame_give_to_kernel(page_table pt, uint32_t frame_n, struct proc *owner){
+    hash_remove(pt, frame_n);
+    proc_frames_remove(pt, owner, frame_n);
+    pt->entries[frame_n].owner = kproc->p_pid;
+    hash_insert(pt, frame_n);
+    proc_frames_append(pt, kproc, frame_n);
+}
+
+//The frame is back in a stable state: wake up the threads waiting for it
+static void frame_unbusy(page_table pt, uint32_t frame_n){
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 0);
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
+
+//Drop the translations of the frame from the TLB of the other CPUs that may cache them, and from ours if local.
+//The shootdowns are only queued, TLB_Shootdown_sync waits for them
+static void frame_invalidate(page_table pt, uint32_t frame_n, bool local){
+    paddr_t frame_address = frame_n * PAGE_SIZE + pt->mem_base_addr;
+    uint32_t others = pt->entries[frame_n].tlb_cpus & ~(1U << curcpu->c_number);
+
+    if(local)
+        TLB_Invalidate(frame_address);
+    if(others != 0)
+        TLB_Shootdown(frame_address, others);
+    pt->entries[frame_n].tlb_cpus = local ? 0 : pt->entries[frame_n].tlb_cpus & ~others;
+}
+
+//True if one of the frames owned or shared by p is in transit
+static bool proc_frames_busy(page_table pt, struct proc *p, bool aliases){
+    uint32_t i, n_frames_left;
+    int a;
+
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+        if(IS_BUSY(pt->entries[i].hi))
+            return true;
+    }
+    for(a = p->start_alias_i; aliases && a != -1; a = pt->aliases[a].proc_next){
+        if(IS_BUSY(pt->entries[pt->aliases[a].frame].hi))
+            return true;
+    }
+    return false;
+}
+
 page_table pageTInit(uint32_t n_pages){
     uint32_t i;
     page_table tmp = kmalloc(sizeof(*tmp));
     tmp->entries = kmalloc(n_pages * sizeof(*(tmp->entries)));
-#if RA
-    tmp->FIFO = kmalloc(n_pages * sizeof(*(tmp->FIFO)));
-    tmp->FIFO_index_start = 0;
-    tmp->FIFO_index_last = n_pages - 1;
+#if RA == FIFO_RA
+    tmp->fifo_head = tmp->fifo_tail = -1;
 #endif
-    tmp->mem_base_addr = ram_stealmem(0);
+    tmp->clock_hand = 0;
     tmp->size = n_pages;
-    frame_n_k = n_pages - 1;
+    //one bucket per frame at least, rounded up to a power of two so that the hash is just a mask
+    for(tmp->hash_size = 1; tmp->hash_size < n_pages; tmp->hash_size <<= 1);
+    tmp->hash_anchor = kmalloc(tmp->hash_size * sizeof(*(tmp->hash_anchor)));
+    tmp->file_anchor = kmalloc(tmp->hash_size * sizeof(*(tmp->file_anchor)));
+    for(i = 0; i < tmp->hash_size; i++){
+        tmp->hash_anchor[i] = -1;
+        tmp->file_anchor[i] = -1;
+    }
+    tmp->n_aliases = n_pages * COW_ALIASES_PER_FRAME;
+    tmp->aliases = kmalloc(tmp->n_aliases * sizeof(*(tmp->aliases)));
+    for(i = 0; i < tmp->n_aliases; i++){
+        tmp->aliases[i].frame = -1;
+        tmp->aliases[i].frame_next = i + 1;
+    }
+    tmp->aliases[tmp->n_aliases - 1].frame_next = -1;
+    tmp->first_free_alias = 0;
+    tmp->kernel_buddy = buddyInit(n_pages);
+    tmp->kernel_npages = kmalloc(n_pages * sizeof(*(tmp->kernel_npages)));
+    for(i = 0; i < n_pages; i++){
+        tmp->kernel_npages[i] = 0;
+    }
+    //the frames start after the memory taken by the structures above, don't go past the end of the RAM
+    tmp->mem_base_addr = ram_stealmem(0);
+    if(n_pages > (mainbus_ramsize() - tmp->mem_base_addr) / PAGE_SIZE){
+        n_pages = (mainbus_ramsize() - tmp->mem_base_addr) / PAGE_SIZE;
+        tmp->size = n_pages;
+    }
+    buddy_add_frames(tmp->kernel_buddy, n_pages);
+    tmp->n_kernel_frames = 0;
+    tmp->ws_total = 0;
+    tmp->ws_nactive = 0;
+    tmp->n_free_frames = n_pages;
     tmp->first_free_frame = 0;
     for(i = 0; i < n_pages - 1; i++){
         //the chain of free frames is built here
         //when the ipt is initialized the list of free frames includes all the frames
         tmp->entries[i].hi = SET_KERNEL(SET_PN(SET_VALID(SET_CHAIN(tmp->entries[i].hi, 1), 0), 0), 0);
-        tmp->entries[i].low = SET_NEXT(SET_PID(tmp->entries[i].low, 0), (i+1));
-        
+        tmp->entries[i].low = SET_NEXT(tmp->entries[i].low, (i+1));
+        tmp->entries[i].prev = (int)i - 1;
+        tmp->entries[i].owner = 0;
+        tmp->entries[i].hash_next = -1;
+        tmp->entries[i].refcount = 0;
+        tmp->entries[i].alias_head = -1;
+        tmp->entries[i].tlb_cpus = 0;
+        tmp->entries[i].file = NULL;
     }
     //the last frame has the chain bit set to 0 (no chain) 
     tmp->entries[i].hi= SET_KERNEL(SET_PN(SET_VALID(SET_CHAIN(tmp->entries[i].hi,0),0),0),0);
-    tmp->entries[i].low = SET_NEXT(SET_PID(tmp->entries[i].low, 0), 0);
+    tmp->entries[i].low = SET_NEXT(tmp->entries[i].low, 0);
+    tmp->entries[i].prev = (int)i - 1;
+    tmp->entries[i].owner = 0;
+    tmp->entries[i].hash_next = -1;
+    tmp->entries[i].refcount = 0;
+    tmp->entries[i].alias_head = -1;
+    tmp->entries[i].tlb_cpus = 0;
+    tmp->entries[i].file = NULL;
     tmp->last_free_frame = i;
     return tmp;
 }
@@ -83,52 +502,57 @@ void addEntry(page_table pt, uint32_t page_n, uint32_t index, uint32_t pid){
 
     //Remove the page from free frames list
     if(pt->first_free_frame != pt->last_free_frame){
-        if(pt->first_free_frame == index){
-            pt->first_free_frame = GET_NEXT(pt->entries[pt->first_free_frame].low);
-        }else{
-            uint32_t i;
-            for(i = pt->first_free_frame; HAS_CHAIN(pt->entries[i].hi) && GET_NEXT(pt->entries[i].low) != index; i = GET_NEXT(pt->entries[i].low));
-            if(i == pt->last_free_frame)
-                panic("Maybe we forgot to add the frame to the free list!\n");
-            if(index == pt->last_free_frame){
-                pt->last_free_frame = i;
-                pt->entries[i].hi = SET_CHAIN(pt->entries[i].hi, 0);
-            }else{
-                pt->entries[i].low = SET_NEXT(pt->entries[i].low, GET_NEXT(pt->entries[index].low));
-            }
-        }
+        frame_list_unlink(pt, &pt->first_free_frame, &pt->last_free_frame, index);
     }
 
     if((page_n << 12) > MIPS_KSEG0){
         //set the frame as part of the kernel
-        pt->entries[index].hi = SET_PN(SET_CHAIN(SET_VALID(SET_KERNEL(pt->entries[index].hi, 1),1), 0), page_n);
-        pt->entries[index].low = SET_PID(SET_NEXT(pt->entries[index].low, 0), pid);
+        pt->entries[index].hi = SET_BUSY(SET_DIRTY(SET_PN(SET_CHAIN(SET_VALID(SET_KERNEL(pt->entries[index].hi, 1),1), 0), page_n), 0), 0);
+        pt->entries[index].low = SET_NEXT(pt->entries[index].low, 0);
     }else{
-        //set the frame as not part of the kernel
-        pt->entries[index].hi = SET_PN(SET_CHAIN(SET_VALID(SET_KERNEL(pt->entries[index].hi, 0),1), 0), page_n);
-        pt->entries[index].low = SET_PID(SET_NEXT(pt->entries[index].low, 0), pid);
+        //set the frame as not part of the kernel, it is going to be accessed right away
+        pt->entries[index].hi = SET_BUSY(SET_DIRTY(SET_REFERENCED(SET_PN(SET_CHAIN(SET_VALID(SET_KERNEL(pt->entries[index].hi, 0),1), 0), page_n), 1), 0), 0);
+        pt->entries[index].low = SET_NEXT(pt->entries[index].low, 0);
     }
+    pt->entries[index].owner = pid;
+    pt->entries[index].refcount = 1;
+    pt->n_free_frames--;
+    hash_insert(pt, index);
 
     // Add the page into process list
-    if(curthread->t_proc->n_frames == 0){
-        //we need to update also the head of the chain
-        curthread->t_proc->start_pt_i = index;
-    }else{
-        //the penultimate frame of the chain is updated
-        //the chain is updated and the next field is updated indexing the last frame
-        pt->entries[curthread->t_proc->last_pt_i].hi = SET_CHAIN(pt->entries[curthread->t_proc->last_pt_i].hi, 1);
-        pt->entries[curthread->t_proc->last_pt_i].low = SET_NEXT(pt->entries[curthread->t_proc->last_pt_i].low, index);
-    }
-    curthread->t_proc->last_pt_i = index;
-    curthread->t_proc->n_frames++;
+    proc_frames_append(pt, curthread->t_proc, index);
     return;
 }
 
 //Return the index where page number is stored in, if page is not stored in memory, return -1
 int getFrameAddress(page_table pt, uint32_t page_n, bool frame){
-    //KASSERT(GET_PID(pt->entries[curthread->t_proc->start_pt_i].low) == curthread->t_proc->p_pid);
+    pid_t pid = curthread->t_proc->p_pid;
+    int i, frame_n = -1;
+
+    for(i = pt->hash_anchor[HASH_IPT(pt, pid, page_n)]; i != -1; i = *hash_next_of(pt, i)){
+        if((uint32_t)i < pt->size){
+            if(GET_PN(pt->entries[i].hi) == page_n && pt->entries[i].owner == pid){
+                frame_n = i;
+                break;
+            }
+        }else if(pt->aliases[i - pt->size].pn == page_n && pt->aliases[i - pt->size].pid == pid){
+            //the frame is shared copy-on-write with its owner
+            frame_n = pt->aliases[i - pt->size].frame;
+            break;
+        }
+    }
+
+    if(frame_n == -1 || frame)
+        return frame_n;
+    return frame_n * PAGE_SIZE + pt->mem_base_addr;
+}
+
+//Same as getFrameAddress, but walking the process frames list: kept only to compare the two lookups
+int getFrameAddressChain(page_table pt, uint32_t page_n, bool frame){
     uint32_t frame_n = -1;
-    
+
+    if(curthread->t_proc->n_frames == 0)
+        return frame_n;
     for(int i = curthread->t_proc->start_pt_i; i != -1; i = GET_NEXT(pt->entries[i].low)){
         if(GET_PN(pt->entries[i].hi) == page_n){
             if(frame)
@@ -144,209 +568,877 @@ int getFrameAddress(page_table pt, uint32_t page_n, bool frame){
     return frame_n;
 }
 
-uint32_t replace_page(page_table pt){
+//Frames of a process within its resident set target are left to the replacement as long as there are other victims:
+//the process that goes over its target pays for its faults, not the others
+static bool frame_protected(page_table pt, uint32_t frame_n){
+    struct proc *p = proc_search_pid(pt->entries[frame_n].owner);
+
+    return p != NULL && p->ws_target > 0 && !p->ws_suspended && p->n_frames <= p->ws_target;
+}
 
-    uint32_t page_index;
+static int replace_page_policy(page_table pt, bool protect){
+
+    uint32_t page_index, n;
     
-#if RA
-    //print_FIFO(pt);
-    do{
-        pt->FIFO_index_last = (pt->FIFO_index_last + 1) % pt->size;
-        page_index = pt->FIFO[pt->FIFO_index_last];
-    }while(IS_KERNEL(pt->entries[page_index].hi));
+    //frames in transit are skipped, give up after looking at every frame (twice for the clock)
+#if RA == FIFO_RA
+    //the queue holds only valid user frames, the victim leaves it when it is freed.
+    //The frames skipped go to the tail, so that the next search doesn't start from them again
+    for(n = 0; n < pt->size && pt->fifo_head != -1; n++){
+        page_index = pt->fifo_head;
+        KASSERT(IS_VALID(pt->entries[page_index].hi) && !IS_KERNEL(pt->entries[page_index].hi));
+        if(!IS_BUSY(pt->entries[page_index].hi) && !(protect && frame_protected(pt, page_index)))
+            return page_index;
+        fifo_unlink(pt, page_index);
+        fifo_append(pt, page_index);
+    }
+#elif RA == CLOCK_RA
+    for(n = 0; n < 2 * pt->size; n++){
+        page_index = pt->clock_hand;
+        pt->clock_hand = (pt->clock_hand + 1) % pt->size;
+        if(!IS_VALID(pt->entries[page_index].hi) || IS_KERNEL(pt->entries[page_index].hi) || IS_BUSY(pt->entries[page_index].hi) ||
+            (protect && frame_protected(pt, page_index)))
+            continue;
+        if(!IS_REFERENCED(pt->entries[page_index].hi))
+            return page_index;
+        //second chance: clear the bit and drop the translation,
+        //so that the next access refaults and sets the bit again
+        pt->entries[page_index].hi = SET_REFERENCED(pt->entries[page_index].hi, 0);
+        frame_invalidate(pt, page_index, true);
+    }
 #else
-    page_index = random() % (frame_n_k + 1);
-    (void) pt;
+    for(n = 0; n < pt->size; n++){
+        page_index = random() % pt->size;
+        if(!IS_KERNEL(pt->entries[page_index].hi) && !IS_BUSY(pt->entries[page_index].hi) &&
+            !(protect && frame_protected(pt, page_index)))
+            return page_index;
+    }
 #endif
 
-    return page_index;
+    return -1;
+}
+
+int replace_page(page_table pt){
+    int frame_n = replace_page_policy(pt, true);
+
+    return frame_n != -1 ? frame_n : replace_page_policy(pt, false);
+}
+
+//Grow the read-ahead window of p when a page read ahead is used, halve it when one is wasted
+static void readahead_adjust(struct proc *p, bool hit){
+    if(hit){
+        /*statistics*/add_VM_readahead_hit();
+        if(p->ra_window < READAHEAD_MAX_WINDOW)
+            p->ra_window++;
+    }else{
+        /*statistics*/add_VM_readahead_miss();
+        if(p->ra_window > 1)
+            p->ra_window /= 2;
+    }
+}
+
+void set_page_referenced(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    pt->entries[frame_n].hi = SET_REFERENCED(pt->entries[frame_n].hi, 1);
+    if(IS_READAHEAD(pt->entries[frame_n].hi)){
+        pt->entries[frame_n].hi = SET_READAHEAD(pt->entries[frame_n].hi, 0);
+        readahead_adjust(curthread->t_proc, true);
+    }
+}
+
+void set_page_cached(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    pt->entries[frame_n].tlb_cpus |= 1U << curcpu->c_number;
+}
+
+void set_page_dirty(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    pt->entries[frame_n].hi = SET_DIRTY(pt->entries[frame_n].hi, 1);
+}
+
+bool is_page_writable(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    return IS_DIRTY(pt->entries[frame_n].hi) && (pt->entries[frame_n].refcount == 1 || IS_MAPPED_FILE(pt, frame_n));
+}
+
+bool is_page_busy(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    return IS_BUSY(pt->entries[frame_n].hi);
+}
+
+bool is_page_preloadable(page_table pt, paddr_t paddr){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE, hi = pt->entries[frame_n].hi;
+
+#if RA == CLOCK_RA
+    if(!IS_REFERENCED(hi))
+        return false;
+#endif
+    return !IS_BUSY(hi) && !IS_READAHEAD(hi);
+}
+
+paddr_t page_unshare(page_table pt, vaddr_t vaddr, paddr_t paddr, swap_table st){
+    uint32_t frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    struct proc *p = curthread->t_proc;
+    paddr_t new_paddr;
+    int a;
+
+    //the processes mapping a file shared see each other's writes
+    if(pt->entries[frame_n].refcount == 1 || IS_MAPPED_FILE(pt, frame_n))
+        return paddr;
+
+    //the frame must not be chosen as victim to make room for the copy
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+    if(pt->entries[frame_n].owner == p->p_pid){
+        frame_give_away(pt, frame_n, p);
+    }else{
+        for(a = pt->entries[frame_n].alias_head; pt->aliases[a].pid != p->p_pid; a = pt->aliases[a].frame_next);
+        alias_remove(pt, a, p);
+    }
+    //the process could move to another CPU that still maps the page to the frame
+    frame_invalidate(pt, frame_n, false);
+    TLB_Shootdown_sync();
+    new_paddr = insert_page(pt, vaddr, st, -1);
+    memcpy((void *)PADDR_TO_KVADDR(new_paddr), (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    frame_unbusy(pt, frame_n);
+    set_page_dirty(pt, new_paddr);
+    /*statistics*/add_COW_copy();
+    return new_paddr;
+}
+
+//Frame holding the page page_n owned by pid, -1 if it is not resident (aliases are not looked up)
+static int frame_lookup(page_table pt, uint32_t pid, uint32_t page_n){
+    int i;
+
+    for(i = pt->hash_anchor[HASH_IPT(pt, pid, page_n)]; i != -1; i = *hash_next_of(pt, i)){
+        if((uint32_t)i < pt->size && GET_PN(pt->entries[i].hi) == page_n && pt->entries[i].owner == pid)
+            return i;
+    }
+    return -1;
+}
+
+//True if the frame holds a page that has never been written to the swap file, so that it can be written in a run of
+//chunks with its neighbours. busy tells the state expected for the frame: the victim is already busy
+static bool cluster_candidate(page_table pt, int frame_n, swap_table st, bool busy){
+    uint32_t hi;
+
+    if(frame_n == -1)
+        return false;
+    hi = pt->entries[frame_n].hi;
+    if(!IS_VALID(hi) || IS_KERNEL(hi) || !IS_DIRTY(hi) || (IS_BUSY(hi) != 0) != busy || pt->entries[frame_n].refcount != 1 ||
+        pt->entries[frame_n].file != NULL)
+        return false;
+#if RA == CLOCK_RA
+    //a neighbour used since the clock hand passed is not a victim
+    if(!busy && IS_REFERENCED(hi))
+        return false;
+#endif
+    return getSwapChunk(st, GET_PN(hi) << 12, pt->entries[frame_n].owner) == -1;
+}
+
+//The victim and the pages of its process next to it that are candidates too, in the order of their addresses,
+//SWAPOUT_CLUSTER at most. The neighbours are made busy: they are victims as well
+static uint32_t cluster_pick(page_table pt, uint32_t frame_n, swap_table st, uint32_t *cluster){
+    uint32_t page_n = GET_PN(pt->entries[frame_n].hi), pid = pt->entries[frame_n].owner, first, last, n;
+
+    cluster[0] = frame_n;
+    if(!cluster_candidate(pt, frame_n, st, true))
+        return 1;
+    for(first = page_n; page_n - first + 1 < SWAPOUT_CLUSTER && first > 0 &&
+        cluster_candidate(pt, frame_lookup(pt, pid, first - 1), st, false); first--);
+    for(last = page_n; last - first + 1 < SWAPOUT_CLUSTER && last + 1 < (MIPS_KSEG0 >> 12) &&
+        cluster_candidate(pt, frame_lookup(pt, pid, last + 1), st, false); last++);
+    for(n = 0; first <= last; first++, n++){
+        cluster[n] = frame_lookup(pt, pid, first);
+        pt->entries[cluster[n]].hi = SET_BUSY(pt->entries[cluster[n]].hi, 1);
+    }
+    return n;
+}
+
+//Write the cluster picked for a victim in a run of chunks, with a single request, and free the neighbours.
+//False if there is no run long enough: the neighbours are left in memory
+static bool page_out_cluster(page_table pt, uint32_t *cluster, uint32_t n, swap_table st){
+    paddr_t paddrs[SWAPOUT_CLUSTER];
+    uint32_t page_numbers[SWAPOUT_CLUSTER], pid = pt->entries[cluster[0]].owner, i;
+    int run = getFreeChunkRun(st, n);
+
+    if(run == -1)
+        return false;
+    for(i = 0; i < n; i++){
+        paddrs[i] = cluster[i] * PAGE_SIZE + pt->mem_base_addr;
+        page_numbers[i] = GET_PN(pt->entries[cluster[i]].hi);
+    }
+    swapout_cluster(st, run, paddrs, page_numbers, n, pid);
+    /*statistics*/add_SWAP_cluster(n);
+    for(i = 0; i < n; i++){
+        /*statistics*/add_SWAP_write();
+    }
+    return true;
+}
+
+//Evict the page stored in frame_n: only dirty pages are written to the swap file, or to their file if mapped shared,
+//clean ones still have a valid copy there (or are zero-filled again on the next fault).
+//The caller marks the frame busy, vm_lock is released during the writes
+static void page_out(page_table pt, uint32_t frame_n, swap_table st){
+    paddr_t frame_address = frame_n * PAGE_SIZE + pt->mem_base_addr;
+    uint32_t page_n = GET_PN(pt->entries[frame_n].hi), pid = pt->entries[frame_n].owner;
+    uint32_t cluster[SWAPOUT_CLUSTER], n, i;
+    int chunk_index, a;
+    uint32_t a_pn;
+    pid_t a_pid;
+
+    KASSERT(IS_BUSY(pt->entries[frame_n].hi));
+    //a victim that was never written out takes its dirty neighbours along
+    n = cluster_pick(pt, frame_n, st, cluster);
+    //from now on an access to the pages faults and waits for the frames, so they can't change while they are written,
+    //on any CPU
+    for(i = 0; i < n; i++){
+        frame_invalidate(pt, cluster[i], true);
+    }
+    TLB_Shootdown_sync();
+
+    if(n > 1){
+        if(page_out_cluster(pt, cluster, n, st)){
+            for(i = 0; i < n; i++){
+                if(cluster[i] != frame_n)
+                    remove_page(pt, cluster[i]);
+            }
+            return;
+        }
+        //no run of chunks that long, the victim goes alone
+        for(i = 0; i < n; i++){
+            if(cluster[i] != frame_n)
+                frame_unbusy(pt, cluster[i]);
+        }
+    }
+
+    //the processes sharing the frame get their own copy in the swap file. Pages of files are read from them again
+    while(pt->entries[frame_n].alias_head != -1){
+        a = pt->entries[frame_n].alias_head;
+        a_pn = pt->aliases[a].pn;
+        a_pid = pt->aliases[a].pid;
+        if(pt->entries[frame_n].file != NULL){
+            alias_remove(pt, a, proc_search_pid(a_pid));
+            continue;
+        }
+        chunk_index = getSwapChunk(st, a_pn << 12, a_pid);
+        if(chunk_index == -1)
+            chunk_index = getFirstFreeChunckIndex(st);
+        if(chunk_index == -1){
+            panic("\nOut of swap space\n");
+        }
+        alias_remove(pt, a, proc_search_pid(a_pid));
+        swapout(st, chunk_index, frame_address, a_pn, a_pid);
+        /*statistics*/add_SWAP_write();
+    }
+
+    if(!IS_DIRTY(pt->entries[frame_n].hi)){
+        /*statistics*/add_SWAP_clean_eviction();
+        return;
+    }
+    if(IS_MAPPED_FILE(pt, frame_n)){
+        file_writeback(pt, frame_n);
+        return;
+    }
+    //overwrite the stale copy, if any
+    chunk_index = getSwapChunk(st, page_n << 12, pid);
+    if(chunk_index == -1)
+        chunk_index = getFirstFreeChunckIndex(st);
+    if(chunk_index == -1){
+        panic("\nOut of swap space\n");
+    }
+    swapout(st, chunk_index, frame_address, page_n, pid);
+    /*statistics*/add_SWAP_write();
+}
+
+//Evict the next victim of the replacement policy, the frame is free when this returns.
+//Sleep instead if every frame is in transit
+static void evict_page(page_table pt, swap_table st){
+    int frame_n = replace_page(pt);
+
+    if(frame_n == -1){
+        wchan_sleep(vm_wchan, &vm_lock);
+        return;
+    }
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+    page_out(pt, frame_n, st);
+    remove_page(pt, frame_n);
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
+
+//Victim among the frames of p, oldest first, after a second chance for the referenced ones with the clock policy.
+//-1 if they are all kernel frames or in transit
+static int replace_page_local(page_table pt, struct proc *p){
+    uint32_t i, n_frames_left, pass;
+
+    for(pass = 0; pass < 2; pass++){
+        for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+            if(IS_KERNEL(pt->entries[i].hi) || IS_BUSY(pt->entries[i].hi))
+                continue;
+#if RA == CLOCK_RA
+            if(IS_REFERENCED(pt->entries[i].hi)){
+                pt->entries[i].hi = SET_REFERENCED(pt->entries[i].hi, 0);
+                frame_invalidate(pt, i, true);
+                continue;
+            }
+#endif
+            return i;
+        }
+    }
+    return -1;
+}
+
+//Local replacement: a process over its resident set target makes room evicting one of its own pages.
+//False if it has none to give
+static bool evict_page_local(page_table pt, swap_table st, struct proc *p){
+    int frame_n = replace_page_local(pt, p);
+
+    if(frame_n == -1)
+        return false;
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+    page_out(pt, frame_n, st);
+    remove_page(pt, frame_n);
+    wchan_wakeall(vm_wchan, &vm_lock);
+    /*statistics*/add_WS_local_eviction();
+    return true;
+}
+
+static uint32_t ws_capacity(page_table pt){
+    return pt->size - pt->n_kernel_frames;
+}
+
+static uint32_t ms_since(const struct timespec *then){
+    struct timespec now, delta;
+
+    gettime(&now);
+    timespec_sub(&now, then, &delta);
+    return delta.tv_sec * 1000 + delta.tv_nsec / 1000000;
+}
+
+//Page fault frequency: faults coming close together mean that the resident set is smaller than the working set,
+//a long time without faults that it is larger
+static void ws_fault(page_table pt, struct proc *p){
+    uint32_t ms, shrink, old_target = p->ws_target;
+
+    if(p->ws_target == 0){
+        p->ws_target = WS_INITIAL_TARGET;
+        pt->ws_total += p->ws_target;
+        pt->ws_nactive++;
+        gettime(&p->ws_last_fault);
+        return;
+    }
+    ms = ms_since(&p->ws_last_fault);
+    gettime(&p->ws_last_fault);
+    if(ms < PFF_GROW_MS){
+        if(p->ws_target < ws_capacity(pt))
+            p->ws_target++;
+    }else if(ms > PFF_SHRINK_MS){
+        shrink = ms / PFF_SHRINK_MS;
+        p->ws_target = p->ws_target > WS_MIN_TARGET + shrink ? p->ws_target - shrink : WS_MIN_TARGET;
+    }
+    pt->ws_total = pt->ws_total - old_target + p->ws_target;
+}
+
+//Evict every page of the process pid, as long as the load control keeps it swapped out: it may exit meanwhile
+static void proc_swap_out(page_table pt, swap_table st, pid_t pid){
+    struct proc *p;
+    uint32_t i, n_frames_left;
+    int frame_n;
+    bool busy;
+
+    for(;;){
+        p = proc_search_pid(pid);
+        if(p == NULL || !p->ws_suspended)
+            return;
+        frame_n = -1;
+        busy = false;
+        for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+            if(IS_KERNEL(pt->entries[i].hi))
+                continue;
+            if(IS_BUSY(pt->entries[i].hi)){
+                busy = true;
+                continue;
+            }
+            frame_n = i;
+            break;
+        }
+        if(frame_n == -1){
+            if(!busy)
+                return;
+            wchan_sleep(vm_wchan, &vm_lock);
+            continue;
+        }
+        pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+        page_out(pt, frame_n, st);
+        remove_page(pt, frame_n);
+        wchan_wakeall(vm_wchan, &vm_lock);
+    }
+}
+
+//Load control: while the working sets of the processes don't fit in RAM together, swap out the one with the largest
+//target (the faulting process aside), so that the others stop stealing each other's frames
+static void ws_load_control(page_table pt, swap_table st){
+    struct proc *p, *victim;
+    pid_t pid, max_pid;
+
+    while(pt->ws_total > ws_capacity(pt) && pt->ws_nactive > 1){
+        victim = NULL;
+        max_pid = proc_max_pid();
+        for(pid = 1; pid <= max_pid; pid++){
+            p = proc_search_pid(pid);
+            if(p != NULL && p != curthread->t_proc && p->ws_target > 0 && !p->ws_suspended &&
+                (victim == NULL || p->ws_target > victim->ws_target))
+                victim = p;
+        }
+        if(victim == NULL)
+            return;
+        victim->ws_suspended = true;
+        gettime(&victim->ws_suspend_time);
+        pt->ws_total -= victim->ws_target;
+        pt->ws_nactive--;
+        /*statistics*/add_WS_suspension();
+        proc_swap_out(pt, st, victim->p_pid);
+    }
+}
+
+void ws_wait_active(page_table pt){
+    struct proc *p = curthread->t_proc;
+
+    while(p->ws_suspended){
+        //back in when its working set fits, when it is alone or after a while anyway, not to starve it
+        if(pt->ws_total + p->ws_target <= ws_capacity(pt) || pt->ws_nactive == 0 ||
+            ms_since(&p->ws_suspend_time) >= LOAD_MAX_SUSPEND_MS){
+            p->ws_suspended = false;
+            pt->ws_total += p->ws_target;
+            pt->ws_nactive++;
+            /*statistics*/add_WS_resume();
+            return;
+        }
+        wchan_sleep(vm_wchan, &vm_lock);
+    }
+}
+
+uint32_t get_n_free_frames(page_table pt){
+    return pt->n_free_frames;
+}
+
+paddr_t get_mem_base_addr(page_table pt){
+    return pt->mem_base_addr;
+}
+
+bool pageout_frame(page_table pt, swap_table st){
+    int frame_n = replace_page(pt);
+    bool dirty;
+
+    //free frames, kernel pages and shared frames are left to the fault path
+    if(frame_n == -1 || !IS_VALID(pt->entries[frame_n].hi) || IS_KERNEL(pt->entries[frame_n].hi) || pt->entries[frame_n].refcount > 1){
+#if RA == FIFO_RA
+        //a shared frame would be the next pick again
+        if(frame_n != -1){
+            fifo_unlink(pt, frame_n);
+            fifo_append(pt, frame_n);
+        }
+#endif
+        return false;
+    }
+
+    //the page can't be written or freed while it is busy, so it is still there once the swapout is over
+    dirty = IS_DIRTY(pt->entries[frame_n].hi);
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+    page_out(pt, frame_n, st);
+    remove_page(pt, frame_n);
+    wchan_wakeall(vm_wchan, &vm_lock);
+    if(dirty){
+        /*statistics*/add_PAGEOUT_clean();
+    }
+    return true;
+}
+
+//Take frames for the pages following vaddr whose copies are in the chunks following chunk_index, up to the read-ahead
+//window of the process and as long as there are free frames: nothing is evicted for them. Return the cluster size
+static uint32_t readahead_cluster(page_table pt, uint32_t pid, vaddr_t vaddr, uint32_t chunk_index, swap_table st, paddr_t *cluster){
+    uint32_t n, frame_n;
+    vaddr_t next;
+
+    for(n = 1; n <= curthread->t_proc->ra_window; n++){
+        next = vaddr + n * PAGE_SIZE;
+        if(pt->n_free_frames == 0 || next >= MIPS_KSEG0 || getFrameAddress(pt, next >> 12, true) != -1 ||
+            !chunk_holds_page(st, chunk_index + n, next, pid))
+            break;
+        cluster[n] = insert_page(pt, next, st, -1);
+        //not accessed yet: the first access tells a hit, and the replacement does not keep it for a reference it did not get
+        frame_n = (cluster[n] - pt->mem_base_addr) / PAGE_SIZE;
+        pt->entries[frame_n].hi = SET_READAHEAD(SET_REFERENCED(SET_BUSY(pt->entries[frame_n].hi, 1), 0), 1);
+    }
+    /*statistics*/add_VM_readahead(n - 1);
+    return n;
 }
 
 paddr_t pageIn(page_table pt, uint32_t pid, vaddr_t vaddr, swap_table ST) {
-    paddr_t paddr;
-    int chunk_index;
+    paddr_t paddr, cluster[READAHEAD_MAX_WINDOW + 1];
+    uint32_t frame_n, n, i;
+    int chunk_index, cached_frame = -1;
+    uint32_t file_page = 0;
+    bool from_file;
+    struct vnode *file = NULL;
 
+    //the kernel threads stay out of the working set accounting
+    if(curthread->t_proc != kproc){
+        ws_fault(pt, curthread->t_proc);
+        ws_load_control(pt, ST);
+    }
+    //a text page may be in memory already for another process running the same executable, a page of a shared mapping
+    //for another process mapping the file: map that frame
+    if(getSwapChunk(ST, vaddr, pid) == -1 && (file = file_of(vaddr, &file_page)) != NULL){
+        while((cached_frame = file_lookup(pt, file, file_page)) != -1 && IS_BUSY(pt->entries[cached_frame].hi))
+            wchan_sleep(vm_wchan, &vm_lock);
+        if(cached_frame != -1 && alias_add(pt, cached_frame, curthread->t_proc, vaddr >> 12)){
+            if(file_page & FILE_PAGE_TEXT){
+                /* statistics */ add_TEXT_share();
+            }else{
+                /* statistics */ add_MMAP_share();
+            }
+            return cached_frame * PAGE_SIZE + pt->mem_base_addr;
+        }
+    }
     paddr = insert_page(pt, vaddr, ST, -1);
+    //the page is in transit until it is loaded: faults on it wait and the replacement leaves it alone
+    frame_n = (paddr - pt->mem_base_addr) / PAGE_SIZE;
+    pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
     //load a frame in memory
     chunk_index = getSwapChunk(ST, vaddr, pid);
     if(chunk_index != -1){
-        /* Getting the new page from the swap file */
-        swapin(ST, chunk_index, paddr);
+        /* Getting the new page from the swap file, with the next ones of the process if they follow it there */
+        cluster[0] = paddr;
+        n = readahead_cluster(pt, pid, vaddr & PAGE_FRAME, chunk_index, ST, cluster);
+        swapin(ST, chunk_index, cluster, n);
+        for(i = 1; i < n; i++){
+            frame_unbusy(pt, (cluster[i] - pt->mem_base_addr) / PAGE_SIZE);
+        }
         /* statistics */ add_VM_pageFault(VM_SWAP);
+    }else{
+        //the processes faulting on the page from now on wait for it. With no aliases left for the cached copy there are two:
+        //both stay in the cache, so that the changes to both go back to the file
+        if(file != NULL)
+            file_insert(pt, frame_n, file, file_page);
+        spinlock_release(&vm_lock);
+        from_file = as_load_page(proc_getas(), vaddr, paddr);
+        if(!from_file){
+            /* Stack and bss pages start zero-filled */
+            bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+        }
+        spinlock_acquire(&vm_lock);
+        //the pages of the mapped files count as disk faults, those of the executable as ELF ones
+        /* statistics */ add_VM_pageFault(!from_file ? VM_ZEROED : as_mmap_find(proc_getas(), vaddr) != NULL ? VM_DISK : VM_ELF);
     }
-    /* statistics */ add_VM_pageFault(VM_ZEROED);
+    frame_unbusy(pt, frame_n);
     return paddr;
 }
 
+//Free the frame, p being its owner (NULL if it has none)
+static void frame_free(page_table pt, uint32_t frame_n, struct proc *p){
+#if RA == FIFO_RA
+    if(!IS_KERNEL(pt->entries[frame_n].hi))
+        fifo_unlink(pt, frame_n);
+#endif
+    hash_remove(pt, frame_n);
+    if(pt->entries[frame_n].file != NULL)
+        file_remove(pt, frame_n);
+    pt->entries[frame_n].refcount = 0;
+    pt->n_free_frames++;
+    // Remove the page from process list
+    if(p != NULL){
+        proc_frames_remove(pt, p, frame_n);
+        if(IS_READAHEAD(pt->entries[frame_n].hi))
+            readahead_adjust(p, false);
+    }
+    // Insert the page into free list
+    frame_list_append(pt, &pt->first_free_frame, &pt->last_free_frame, IS_FULL(pt), frame_n);
+    pt->entries[frame_n].hi = SET_READAHEAD(SET_BUSY(SET_DIRTY(SET_REFERENCED(SET_KERNEL(SET_PN(SET_VALID(SET_CHAIN(pt->entries[frame_n].hi, 0), 0), 0), 0), 0), 0), 0), 0);
+    pt->entries[frame_n].owner = 0;
+}
+
 void  all_proc_page_out(page_table pt){
     int i, n_frames_left, tmp;
+    struct proc *p = curthread->t_proc;
 
-    if(curthread->t_proc->n_frames > 1){
-        for(i = curthread->t_proc->start_pt_i, n_frames_left = curthread->t_proc->n_frames; n_frames_left > 0; i = tmp, n_frames_left--){
-            tmp = GET_NEXT(pt->entries[i].low);
-            remove_page(pt, i);
-        }
-    }else{
-        remove_page(pt, curthread->t_proc->start_pt_i);
+    //wait for the frames other threads are writing out or copying
+    while(proc_frames_busy(pt, p, false))
+        wchan_sleep(vm_wchan, &vm_lock);
+
+    //its working set leaves the RAM to the others, and to the processes swapped out by the load control
+    if(p->ws_target > 0 && !p->ws_suspended){
+        pt->ws_total -= p->ws_target;
+        pt->ws_nactive--;
+    }
+    p->ws_target = 0;
+    p->ws_suspended = false;
+    wchan_wakeall(vm_wchan, &vm_lock);
+
+    //the ASID is not handed out again before the next flush, dropping its translations just leaves the slots free
+    TLB_Invalidate_range(0, MIPS_KSEG0);
+
+    //stop sharing the frames owned by other processes
+    while(p->start_alias_i != -1){
+        alias_remove(pt, p->start_alias_i, p);
+    }
+
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = tmp, n_frames_left--){
+        tmp = GET_NEXT(pt->entries[i].low);
+        if(IS_KERNEL(pt->entries[i].hi))
+            frame_give_to_kernel(pt, i, p);
+        else if(pt->entries[i].refcount > 1)
+            frame_give_away(pt, i, p);
+        else
+            frame_free(pt, i, p);
     }
 }
 
 
 paddr_t alloc_n_contiguos_pages(uint32_t npages, page_table pt){
-	uint32_t i, index;
-
-    int free_chunk_index;
+    uint32_t i;
+    int first;
 
-    spinlock_acquire(&k_lock);
-    index = frame_n_k;
+    //reserve the block first: the evictions below release vm_lock, and other threads may allocate kernel pages meanwhile.
+    //The frames of the block past npages are left to the user pages
+    first = buddy_alloc(pt->kernel_buddy, buddy_order(npages));
+    if(first == -1)
+        panic("\nPage table full of kernel pages!\n");
+    pt->kernel_npages[first] = npages;
+    pt->n_kernel_frames += npages;
 
-    for(i=frame_n_k; i > frame_n_k - npages; i--){
-        if(IS_VALID(pt->entries[i].hi)){
-            free_chunk_index= getFirstFreeChunckIndex(ST);
-            if(free_chunk_index == -1){
-                panic("\nOut of swap space\n");
+    for(i = first; i < first + npages; i++){
+        while(IS_VALID(pt->entries[i].hi)){
+            if(IS_BUSY(pt->entries[i].hi)){
+                wchan_sleep(vm_wchan, &vm_lock);
+                continue;
             }
-            spinlock_release(&k_lock);
-            swapout(ST, free_chunk_index, (i*PAGE_SIZE) + pt->mem_base_addr, GET_PN(pt->entries[i].hi), GET_PID(pt->entries[i].low), true);
-            spinlock_acquire(&k_lock);
+            pt->entries[i].hi = SET_BUSY(pt->entries[i].hi, 1);
+            page_out(pt, i, ST);
             remove_page(pt, i);
+            wchan_wakeall(vm_wchan, &vm_lock);
         }
         insert_page(pt, (PADDR_TO_KVADDR((i* PAGE_SIZE) + pt->mem_base_addr)), ST, i);
     }
 
-    frame_n_k -= npages;
-    if(frame_n_k < 0)
-        panic("\nPage table full of kernel pages!\n");
+    return first * PAGE_SIZE + pt->mem_base_addr;
+}
 
-    if(start_index_k == -1){
-        start_index_k = start_free_index;
-        start_free_index = k_frames[start_free_index].next;
-        k_frames[start_index_k].start_frame_n_to_remove = index;
-        k_frames[start_index_k].vaddr_to_free = PADDR_TO_KVADDR(((index * PAGE_SIZE) + pt->mem_base_addr) & PAGE_FRAME);
-        k_frames[start_index_k].owner = curthread->t_proc->p_pid;
-        k_frames[start_index_k].n_pages = npages;
-        k_frames[start_index_k].next = -1;
-        k_frames[start_index_k].prev = -1;
-    }else{
-        int i;
-        for(i = start_index_k; k_frames[i].next != -1; i = k_frames[i].next);
-        k_frames[i].next = start_free_index;
-        k_frames[start_free_index].prev = i;
-        start_free_index = k_frames[start_free_index].next;
-        k_frames[k_frames[i].next].next = -1;
-        k_frames[i].start_frame_n_to_remove = index;
-        k_frames[i].vaddr_to_free = PADDR_TO_KVADDR(((index * PAGE_SIZE) + pt->mem_base_addr) & PAGE_FRAME);
-        k_frames[i].owner = curthread->t_proc->p_pid;
-        k_frames[i].n_pages = npages;
-    }
-    spinlock_release(&k_lock);
+void free_n_contiguos_pages(paddr_t paddr, page_table pt){
+    uint32_t i, first = (paddr - pt->mem_base_addr) / PAGE_SIZE, npages;
 
-    return ((index * PAGE_SIZE) + pt->mem_base_addr) & PAGE_FRAME;
-	
+    npages = pt->kernel_npages[first];
+    if(npages == 0)
+        panic("Where is that frame?!\n");
+    pt->kernel_npages[first] = 0;
+    pt->n_kernel_frames -= npages;
+    for(i = first; i < first + npages; i++){
+        remove_page(pt, i);
+    }
+    buddy_free(pt->kernel_buddy, first, buddy_order(npages));
 }
 
 paddr_t insert_page(page_table pt, vaddr_t vaddr, swap_table ST, int suggested_frame_n){
 
     paddr_t frame_address;
     uint32_t frame_n;
+    struct proc *p = curthread->t_proc;
 
     if(suggested_frame_n == -1){
-        if(IS_FULL(pt)){
-            int free_chunk_index;
-            frame_n = replace_page(pt);
-            frame_address = frame_n * PAGE_SIZE + pt->mem_base_addr;
-            free_chunk_index = getFirstFreeChunckIndex(ST);
-            if(free_chunk_index == -1){
-                panic("\nOut of swap space\n");
-            }
-            swapout(ST, free_chunk_index, frame_address, GET_PN(pt->entries[frame_n].hi), GET_PID(pt->entries[frame_n].low), true);
-            /*statistics*/add_SWAP_write();
-            remove_page(pt, frame_n);
-        }else{
-            frame_n = pt->first_free_frame;
-            frame_address =  frame_n * PAGE_SIZE + pt->mem_base_addr;
+        //vm_lock is released while the victim is written, other threads may take the frame freed meanwhile
+        while(IS_FULL(pt)){
+            //a process over its resident set target replaces its own pages,
+            //the others take the victim of the global policy, which spares the processes within their target
+            if(!(p->ws_target > 0 && p->n_frames >= p->ws_target && evict_page_local(pt, ST, p)))
+                evict_page(pt, ST);
         }
+        frame_n = pt->first_free_frame;
+        frame_address =  frame_n * PAGE_SIZE + pt->mem_base_addr;
     }else{
         frame_n = suggested_frame_n;
         frame_address = frame_n * PAGE_SIZE + pt->mem_base_addr;
     }
     // add an entry in the first free frame of the ipt
     addEntry(pt, (vaddr & PAGE_FRAME) >> 12,  frame_n, curthread->t_proc->p_pid);
-#if RA
-    //Add frame into FIFO
-    pt->FIFO[pt->FIFO_index_start] = frame_n;
-    pt->FIFO_index_start = (pt->FIFO_index_start + 1) % pt->size;
+#if PAGEOUT_DAEMON
+    //start cleaning in the background before the next faults find no free frame
+    if(pt->n_free_frames < PAGEOUT_LOW_WATERMARK)
+        pageout_wakeup();
+#endif
+#if RA == FIFO_RA
+    //the kernel pages are never replaced
+    if(!IS_KERNEL(pt->entries[frame_n].hi))
+        fifo_append(pt, frame_n);
 #endif
     return frame_address;
 }
 
 void remove_page(page_table pt, uint32_t frame_n){
-    struct proc *p = proc_search_pid(GET_PID(pt->entries[frame_n].low));
-    // Remove the page from process list
-    if(p != NULL){
-        if(p->n_frames != 1){
-            if(p->start_pt_i == frame_n){
-                p->start_pt_i = GET_NEXT(pt->entries[frame_n].low);
-            }else{
-                uint32_t i;
-                for(i = p->start_pt_i; HAS_CHAIN(pt->entries[i].hi) && GET_NEXT(pt->entries[i].low) != frame_n; i = GET_NEXT(pt->entries[i].low));
-                if(i == p->last_pt_i)
-                    panic("Are we trying to remove a frame which does not belong to the process it claims to belong to?\n");
-                if(frame_n == p->last_pt_i){
-                    p->last_pt_i = i;
-                    pt->entries[i].hi = SET_CHAIN(pt->entries[i].hi, 0);
-                }else{
-                    pt->entries[i].low = SET_NEXT(pt->entries[i].low, GET_NEXT(pt->entries[frame_n].low));
-                }
-            }
+    //kernel pages of the processes that have exited belong to the kernel process, which is not in the process table
+    frame_free(pt, frame_n, pt->entries[frame_n].owner == 0 ? kproc : proc_search_pid(pt->entries[frame_n].owner));
+}
+
+//Share the frame with the child, or give it its own copy in the swap file if there are no aliases left
+static void page_share(page_table pt, uint32_t frame_n, uint32_t page_n, struct proc *dst){
+    int free_chunk_index;
+
+    if(alias_add(pt, frame_n, dst, page_n)){
+        //the parent may have writable translations of the frame on other CPUs, ours are flushed by pages_fork
+        frame_invalidate(pt, frame_n, false);
+        /*statistics*/add_COW_share();
+        return;
+    }
+    //the child finds a page of a file in the page cache, or reads it again
+    if(pt->entries[frame_n].file != NULL)
+        return;
+    free_chunk_index = getFirstFreeChunckIndex(ST);
+    if(free_chunk_index == -1){
+        panic("\nOut of swap space\n");
+    }
+    swapout(ST, free_chunk_index, frame_n * PAGE_SIZE + pt->mem_base_addr, page_n, dst->p_pid);
+}
+
+//Set the busy bit of the frames owned or shared by p, its kernel pages apart
+static void pages_set_busy(page_table pt, struct proc *p, uint32_t value){
+    uint32_t i, n_frames_left;
+    int a;
+
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+        if(!IS_KERNEL(pt->entries[i].hi))
+            pt->entries[i].hi = SET_BUSY(pt->entries[i].hi, value);
+    }
+    for(a = p->start_alias_i; a != -1; a = pt->aliases[a].proc_next){
+        pt->entries[pt->aliases[a].frame].hi = SET_BUSY(pt->entries[pt->aliases[a].frame].hi, value);
+    }
+}
+
+void pages_pin(page_table pt){
+    struct proc *p = curthread->t_proc;
+
+    while(proc_frames_busy(pt, p, true))
+        wchan_sleep(vm_wchan, &vm_lock);
+    pages_set_busy(pt, p, 1);
+}
+
+void pages_unpin(page_table pt){
+    pages_set_busy(pt, curthread->t_proc, 0);
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
+
+void pages_release(page_table pt, vaddr_t start, vaddr_t end){
+    struct proc *p = curthread->t_proc;
+    uint32_t i, next, n_frames_left, page_n;
+    int a, a_next;
+
+    while(proc_frames_busy(pt, p, true))
+        wchan_sleep(vm_wchan, &vm_lock);
+
+    //the frames are busy until every CPU has dropped their translations, the shared ones are just not ours anymore
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+        page_n = GET_PN(pt->entries[i].hi);
+        if(!IS_KERNEL(pt->entries[i].hi) && page_n >= start >> 12 && page_n < end >> 12){
+            pt->entries[i].hi = SET_BUSY(pt->entries[i].hi, 1);
+            frame_invalidate(pt, i, true);
+        }
+    }
+    for(a = p->start_alias_i; a != -1; a = a_next){
+        a_next = pt->aliases[a].proc_next;
+        if(pt->aliases[a].pn >= start >> 12 && pt->aliases[a].pn < end >> 12){
+            frame_invalidate(pt, pt->aliases[a].frame, true);
+            alias_remove(pt, a, p);
+        }
+    }
+    TLB_Shootdown_sync();
+
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = next, n_frames_left--){
+        next = GET_NEXT(pt->entries[i].low);
+        page_n = GET_PN(pt->entries[i].hi);
+        if(IS_KERNEL(pt->entries[i].hi) || !IS_BUSY(pt->entries[i].hi) || page_n < start >> 12 || page_n >= end >> 12)
+            continue;
+        if(pt->entries[i].refcount > 1){
+            //the processes sharing it copy-on-write keep the page
+            frame_give_away(pt, i, p);
+            pt->entries[i].hi = SET_BUSY(pt->entries[i].hi, 0);
         }else{
-            p->last_pt_i = p->start_pt_i;
+            frame_free(pt, i, p);
         }
-        p->n_frames--;
     }
-    // Insert the page into free list
-    if(IS_FULL(pt)){
-        pt->first_free_frame = pt->last_free_frame = frame_n;
-    }else{
-        pt->entries[pt->last_free_frame].hi = SET_CHAIN(pt->entries[pt->last_free_frame].hi, 1);
-        pt->entries[pt->last_free_frame].low = SET_NEXT(pt->entries[pt->last_free_frame].low, frame_n);
-        pt->last_free_frame = frame_n;
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
+
+//A dirty page of a shared mapping the process p maps in [start, end), -1 if there is none
+static int proc_dirty_mapped_frame(page_table pt, struct proc *p, vaddr_t start, vaddr_t end){
+    uint32_t i, n_frames_left, page_n;
+    int a;
+
+    for(i = p->start_pt_i, n_frames_left = p->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+        page_n = GET_PN(pt->entries[i].hi);
+        if(IS_MAPPED_FILE(pt, i) && IS_DIRTY(pt->entries[i].hi) && page_n >= start >> 12 && page_n < end >> 12)
+            return i;
+    }
+    for(a = p->start_alias_i; a != -1; a = pt->aliases[a].proc_next){
+        i = pt->aliases[a].frame;
+        if(IS_MAPPED_FILE(pt, i) && IS_DIRTY(pt->entries[i].hi) && pt->aliases[a].pn >= start >> 12 && pt->aliases[a].pn < end >> 12)
+            return i;
     }
-    pt->entries[frame_n].hi = SET_KERNEL(SET_PN(SET_VALID(SET_CHAIN(pt->entries[frame_n].hi, 0), 0), 0), 0);
-    pt->entries[frame_n].low = SET_NEXT(SET_PID(pt->entries[frame_n].low, 0), 0);
+    return -1;
 }
 
-void pages_fork(page_table pt, uint32_t start_src_frame, pid_t dst_pid){
-    uint32_t i;
-    int free_chunk_index;
-    uint32_t frame_address;
-    for(i = start_src_frame; ; i = GET_NEXT(pt->entries[i].low)){
-            free_chunk_index = getFirstFreeChunckIndex(ST);
-            if(free_chunk_index == -1){
-                panic("\nOut of swap space\n");
-            }
-            frame_address = i * PAGE_SIZE + pt->mem_base_addr;
-            swapout(ST, free_chunk_index, frame_address, GET_PN(pt->entries[i].hi), dst_pid, false);
-        if(!HAS_CHAIN(pt->entries[i].hi))
-            break;
+void pages_sync(page_table pt, vaddr_t start, vaddr_t end){
+    struct proc *p = curthread->t_proc;
+    int frame_n;
+
+    for(;;){
+        //a page in transit may be on its way to the file already
+        while(proc_frames_busy(pt, p, true))
+            wchan_sleep(vm_wchan, &vm_lock);
+        frame_n = proc_dirty_mapped_frame(pt, p, start, end);
+        if(frame_n == -1)
+            return;
+        //the writes on any CPU fault and wait until the page is written, then it is dirty again
+        pt->entries[frame_n].hi = SET_BUSY(pt->entries[frame_n].hi, 1);
+        frame_invalidate(pt, frame_n, true);
+        TLB_Shootdown_sync();
+        file_writeback(pt, frame_n);
+        frame_unbusy(pt, frame_n);
     }
+}
+
+void pages_fork(page_table pt, pid_t dst_pid){
+    struct proc *src = curthread->t_proc, *dst = proc_search_pid(dst_pid);
+    uint32_t i, n_frames_left;
+    int a;
 
+    for(i = src->start_pt_i, n_frames_left = src->n_frames; n_frames_left > 0; i = GET_NEXT(pt->entries[i].low), n_frames_left--){
+        if(!IS_KERNEL(pt->entries[i].hi))
+            page_share(pt, i, GET_PN(pt->entries[i].hi), dst);
+    }
+    //frames the parent is already sharing with other processes
+    for(a = src->start_alias_i; a != -1; a = pt->aliases[a].proc_next){
+        page_share(pt, pt->aliases[a].frame, pt->aliases[a].pn, dst);
+    }
+    //the parent may still have writable translations for the frames now shared, the other address spaces keep theirs
+    TLB_Invalidate_range(0, MIPS_KSEG0);
+    TLB_Shootdown_sync();
 }
 
 void print_pt(page_table pt){
     kprintf("\n");
     for(uint32_t i = 0; i < pt->size; i++){
-        kprintf("%2d) Hi: %8x low: %8x next: %2d PID: %2d PN: %8d CHAIN: %1d\n", i, pt->entries[i].hi, pt->entries[i].low, GET_NEXT(pt->entries[i].low), GET_PID(pt->entries[i].low), GET_PN(pt->entries[i].hi), HAS_CHAIN(pt->entries[i].hi));
+        kprintf("%2d) Hi: %8x low: %8x next: %2d PID: %2d PN: %8d CHAIN: %1d\n", i, pt->entries[i].hi, pt->entries[i].low, GET_NEXT(pt->entries[i].low), pt->entries[i].owner, GET_PN(pt->entries[i].hi), HAS_CHAIN(pt->entries[i].hi));
     }
     kprintf("\nFirst free frame: %d\nLast free frame: %d\n",pt->first_free_frame, pt->last_free_frame);
     kprintf("Current process first page index: %d\nCurrent process last page index: %d\n", curthread->t_proc->start_pt_i, curthread->t_proc->last_pt_i);
 }
 
 void print_FIFO(page_table pt){
-    uint32_t i;
-    for(i = 0; i < pt->size; i++){
-        kprintf("%2d) %6d\n", i, pt->FIFO[i]);
+#if RA == FIFO_RA
+    int i, n;
+    for(i = pt->fifo_head, n = 0; i != -1; i = pt->entries[i].fifo_next, n++){
+        kprintf("%2d) %6d\n", n, i);
     }
-    kprintf("FIFO_index_last: %d\n", pt->FIFO_index_last);
-    kprintf("FIFO_index_start: %d\n", pt->FIFO_index_start);
+    kprintf("FIFO head: %d\n", pt->fifo_head);
+    kprintf("FIFO tail: %d\n", pt->fifo_tail);
+#else
+    (void)pt;
+#endif
 }
\ No newline at end of file
@@ -8,13 +8,18 @@
 #include <proc.h>
 #include <current.h>
 #include <vmstats.h>
+#include <bitmap.h>
+#include <wchan.h>
+#include <mainbus.h>
+#include "zswap.h"
 
 // S = Swapped bit (1 when not in swap file, 0 when in)
 // C = Chain bit
 // P = Previous bit (for double linked list)
+// B = Busy bit (the chunk is being written, vm_lock released)
 //<----------------20------------>|<----6-----><-----6--->|
 //_________________________________________________________
-//|       Virtual Page Number     |     |P|C|S|     PID   |  
+//|       Virtual Page Number     |   |B|P|C|S|           |  
 //|_______________________________|_______________________|
 //|                         Next                          |
 //|_______________________________________________________|
@@ -27,8 +32,10 @@
 #define SET_SWAPPED(x, value) (((x) &~ 0x00000040) | (value << 6))
 #define SET_PN(entry, pn) ((entry & 0x00000FFF) | (pn << 12))
 #define GET_PN(entry) ((entry &~ 0x00000FFF) >> 12)
-#define SET_PID(entry, pid) ((entry &~ 0x0000003F) | pid)
-#define GET_PID(entry) (entry & 0x0000003F)
+#define IS_BUSY(x) ((x) & 0x00000200)
+#define SET_BUSY(x, value) (((x) &~ 0x00000200) | (value << 9))
+//Pages transferred by a single swap_io call, at most: a read-ahead cluster or a swap-out cluster
+#define SWAP_IO_MAX (READAHEAD_MAX_WINDOW + 1 > SWAPOUT_CLUSTER ? READAHEAD_MAX_WINDOW + 1 : SWAPOUT_CLUSTER)
 #if LIST_ST
 //the chain is used only for the free chunk list
 #define HAS_CHAIN(x) ((x) & 0x00000080)
@@ -36,12 +43,19 @@
 #define SET_CHAIN(x, value) (((x) &~ 0x00000080) | (value << 7))
 #define IS_FULL(st) (st->first_free_chunk == st->last_free_chunk && !IS_SWAPPED(st->entries[st->first_free_chunk].hi))
 #define SET_PREV(x, value) (((x) &~ 0x00000100) | (value << 8))
+#else
+//Same multiplicative hash as the IPT, the number of buckets is a power of 2
+#define HASH_ST(st, pid, pn) ((((pn) * 2654435761U) ^ (pid)) & ((st)->hash_size - 1))
 #endif
 
 struct STE{
     uint32_t hi;
+    uint16_t owner;             /*Pid of the process the page belongs to, in its own field like in the IPT*/
 #if LIST_ST
     uint32_t next, prev;
+#else
+    int hash_next;              /*Next chunk in the same hash bucket, -1 if it is the last one*/
+    int proc_next;              /*Next chunk of the same process, -1 if it is the last one*/
 #endif
 };
 
@@ -49,9 +63,21 @@ struct swapTable{
     struct vnode *fp;
     struct STE *entries;
     uint32_t size;
+    uint32_t run_rotor;         /*Where the search for the next run of free chunks starts*/
+    char *copy_page;            /*Buffer of the chunk copies made by fork*/
+    bool copy_busy;
+#if ZSWAP
+    zswap_pool cache;           /*Compressed copies of the chunks, the disk is written only when it is full*/
+    char *wb_page;              /*Buffer of the writebacks from the cache to the disk*/
+    bool wb_busy;
+#endif
 #if LIST_ST
     uint32_t first_free_chunk;
     uint32_t last_free_chunk;
+#else
+    struct bitmap *free_map;    /*Chunks in use, including the ones handed out and not written yet*/
+    int *hash_anchor;           /*First chunk of each (pid, page number) bucket, -1 if empty*/
+    uint32_t hash_size;         /*Number of buckets of the hash anchor table*/
 #endif
 };
 
@@ -72,38 +98,42 @@ static void insert_into_process_chunk_list(swap_table st, uint32_t chunk_to_add,
     p->last_st_i = chunk_to_add;
     p->n_chunks++;
 }
-#endif
-
-static void elf_to_swap_transfer(swap_table st, struct vnode *v, char *buffer, uint32_t len_read, uint32_t len_write, uint32_t offset, uint32_t chunk_offset, bool zero){
-    struct iovec iov_swap, iov_elf;
-	struct uio ku_swap, ku_elf;
-    int result;
-    if(zero)
-        bzero((void*)buffer, len_write);
-    uio_kinit(&iov_elf, &ku_elf, buffer, len_read, offset, UIO_READ);
-    result = VOP_READ(v, &ku_elf);
-    if(result) 
-        panic("Failed loading elf into swap area!\n");
-
-    // Write page into swapfile
-    uio_kinit(&iov_swap, &ku_swap, buffer, len_write, chunk_offset, UIO_WRITE);
-    result = VOP_WRITE(st->fp, &ku_swap);
-    if(result) 
-        panic("Failed loading elf into swap area!\n");
+#else
+//The chunk now holds a page: index it by (pid, page number) and add it to the chunks of its process
+static void chunk_add(swap_table st, uint32_t index, pid_t pid){
+    uint32_t bucket = HASH_ST(st, st->entries[index].owner, GET_PN(st->entries[index].hi));
+    struct proc *p = proc_search_pid(pid);
+
+    st->entries[index].hash_next = st->hash_anchor[bucket];
+    st->hash_anchor[bucket] = index;
+    st->entries[index].proc_next = -1;
+    if(p != NULL){
+        st->entries[index].proc_next = p->start_chunk_i;
+        p->start_chunk_i = index;
+    }
 }
 
-static void write_page(swap_table st, char *buffer, uint32_t len_write, uint32_t chunk_offset, bool zero){
-    struct iovec iov_swap;
-	struct uio ku_swap;
-    int result;
-    if(zero)
-        bzero((void*)buffer, len_write);
-    // Write page into swapfile
-    uio_kinit(&iov_swap, &ku_swap, buffer, len_write, chunk_offset, UIO_WRITE);
-    result = VOP_WRITE(st->fp, &ku_swap);
-    if(result) 
-        panic("Failed loading elf into swap area!\n");
+//Release the chunk, the caller takes care of the list of chunks of the process
+static void chunk_free(swap_table st, uint32_t index){
+    uint32_t bucket = HASH_ST(st, st->entries[index].owner, GET_PN(st->entries[index].hi));
+    int i;
+
+    if(st->hash_anchor[bucket] == (int)index){
+        st->hash_anchor[bucket] = st->entries[index].hash_next;
+    }else{
+        for(i = st->hash_anchor[bucket]; i != -1 && st->entries[i].hash_next != (int)index; i = st->entries[i].hash_next);
+        if(i == -1)
+            panic("Chunk %d is not in its hash bucket!\n", index);
+        st->entries[i].hash_next = st->entries[index].hash_next;
+    }
+    st->entries[index].hash_next = -1;
+    st->entries[index].hi = SET_SWAPPED(st->entries[index].hi, 1);
+    bitmap_unmark(st->free_map, index);
+#if ZSWAP
+    zswap_drop(st->cache, index);
+#endif
 }
+#endif
 
 swap_table swapTableInit(char swap_file_name[]){
     struct stat file_stat;
@@ -115,6 +145,19 @@ swap_table swapTableInit(char swap_file_name[]){
     VOP_STAT(result->fp, &file_stat);
     result->size = file_stat.st_size / PAGE_SIZE;
     result->entries = (struct STE*)kmalloc(result->size * sizeof(*(result->entries)));
+    result->run_rotor = 0;
+    result->copy_page = kmalloc(PAGE_SIZE);
+    if(result->copy_page == NULL)
+        panic("VM: Failed to create Swap area\n");
+    result->copy_busy = false;
+#if ZSWAP
+    //the pool is taken before the IPT is set up, it is a fraction of the RAM the IPT would get otherwise
+    result->cache = zswapInit(result->size, (mainbus_ramsize() - ram_stealmem(0)) / PAGE_SIZE * ZSWAP_POOL_PERCENT / 100);
+    result->wb_page = kmalloc(PAGE_SIZE);
+    if(result->wb_page == NULL)
+        panic("VM: Failed to create Swap area\n");
+    result->wb_busy = false;
+#endif
 #if LIST_ST
     result->first_free_chunk = 0;
     for(i = 0; i < result->size - 1; i++){
@@ -141,54 +184,200 @@ swap_table swapTableInit(char swap_file_name[]){
 #else
     for(i = 0; i < result->size; i++){
         result->entries[i].hi = SET_SWAPPED(result->entries[i].hi,1);
+        result->entries[i].hash_next = -1;
+        result->entries[i].proc_next = -1;
+    }
+    result->free_map = bitmap_create(result->size);
+    for(result->hash_size = 1; result->hash_size < result->size; result->hash_size <<= 1);
+    result->hash_anchor = kmalloc(result->hash_size * sizeof(*(result->hash_anchor)));
+    if(result->free_map == NULL || result->hash_anchor == NULL)
+        panic("VM: Failed to create Swap area\n");
+    for(i = 0; i < result->hash_size; i++){
+        result->hash_anchor[i] = -1;
     }
 #endif
 
     return result;
 }
 
-void swapout(swap_table st, uint32_t index, paddr_t paddr, uint32_t page_number, uint32_t pid, bool invalidate){
+//Transfer the chunks starting at index flagged in io (all of them if io is NULL) from or to the frames at paddrs,
+//with one request per run of consecutive flagged chunks. vm_lock is released during the transfers
+static void swap_io(swap_table st, uint32_t index, paddr_t *paddrs, const bool *io, uint32_t n, enum uio_rw rw){
+    struct iovec iov[SWAP_IO_MAX];
+    struct uio swap_uio;
+    uint32_t first, i;
+    int result;
+
+    KASSERT(n <= SWAP_IO_MAX);
+    for(first = 0; first < n; first = i){
+        if(io != NULL && !io[first]){
+            i = first + 1;
+            continue;
+        }
+        for(i = first; i < n && (io == NULL || io[i]); i++){
+            iov[i - first].iov_kbase = (void*)PADDR_TO_KVADDR(paddrs[i] & PAGE_FRAME);
+            iov[i - first].iov_len = PAGE_SIZE;
+        }
+        swap_uio.uio_iov = iov;
+        swap_uio.uio_iovcnt = i - first;
+        swap_uio.uio_offset = (index + first)*PAGE_SIZE;
+        swap_uio.uio_resid = (i - first)*PAGE_SIZE;
+        swap_uio.uio_segflg = UIO_SYSSPACE;
+        swap_uio.uio_rw = rw;
+        swap_uio.uio_space = NULL;
+
+        spinlock_release(&vm_lock);
+        result = rw == UIO_READ ? VOP_READ(st->fp, &swap_uio) : VOP_WRITE(st->fp, &swap_uio);
+        spinlock_acquire(&vm_lock);
+        if(result)
+            panic(rw == UIO_READ ? "VM: SWAPIN Failed" : "VM_SWAP_OUT: Failed");
+    }
+}
+
+#if ZSWAP
+//Make room in the swap cache: the least recently used page there, or the one of the chunk index, goes to the disk.
+//Return after waiting if another thread is writing back, the caller retries. False if there is nothing to write back
+static bool swap_cache_writeback(swap_table st, int index){
     struct uio swap_uio;
     struct iovec iov;
+    int result;
 
-    //update the first_free_chunk index
+    //there is a single writeback buffer
+    if(st->wb_busy){
+        wchan_sleep(vm_wchan, &vm_lock);
+        return true;
+    }
+    if(index == -1)
+        index = zswap_oldest(st->cache);
+    //a chunk being written holds the page going into the cache
+    if(index == -1 || !zswap_has(st->cache, index) || IS_BUSY(st->entries[index].hi))
+        return false;
+    st->wb_busy = true;
+    zswap_evict(st->cache, index, st->wb_page);
+    //a fault on the page reads the chunk after the write
+    st->entries[index].hi = SET_BUSY(st->entries[index].hi, 1);
+    uio_kinit(&iov, &swap_uio, st->wb_page, PAGE_SIZE, index*PAGE_SIZE, UIO_WRITE);
+    spinlock_release(&vm_lock);
+    result = VOP_WRITE(st->fp, &swap_uio);
+    spinlock_acquire(&vm_lock);
+    if(result)
+        panic("VM_SWAP_OUT: Failed");
+    st->entries[index].hi = SET_BUSY(st->entries[index].hi, 0);
+    st->wb_busy = false;
+    /*statistics*/add_ZSWAP_writeback();
+    wchan_wakeall(vm_wchan, &vm_lock);
+    return true;
+}
+
+//Keep the frame at paddr in the swap cache as the content of the chunk index, writing back older pages to make
+//room if needed. False if the page has to be written to the disk
+static bool swap_cache_store(swap_table st, uint32_t index, paddr_t paddr){
+    for(;;){
+        switch(zswap_store(st->cache, index, (void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME))){
+            case ZSWAP_STORED:
+                return true;
+            case ZSWAP_REJECTED:
+                return false;
+            default:
+                if(!swap_cache_writeback(st, -1))
+                    return false;
+        }
+    }
+}
+#endif
+
+void swapout(swap_table st, uint32_t index, paddr_t paddr, uint32_t page_number, uint32_t pid){
+    bool new_chunk;
+
+    //the previous content of the chunk may still be on its way to the disk
+    while(IS_BUSY(st->entries[index].hi))
+        wchan_sleep(vm_wchan, &vm_lock);
+    new_chunk = IS_SWAPPED(st->entries[index].hi);
+
+    //update the first_free_chunk index, unless we are overwriting a chunk the page already owns
 #if LIST_ST  
-    delete_free_chunk(st, index);
-    insert_into_process_chunk_list(st, index, curthread->t_proc);
+    if(new_chunk){
+        //the page may belong to another process (eviction, pageout daemon)
+        delete_free_chunk(st, index);
+        insert_into_process_chunk_list(st, index, proc_search_pid(pid));
+    }
 #endif
-    uio_kinit(&iov, &swap_uio, (void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), PAGE_SIZE, index*PAGE_SIZE, UIO_WRITE);
-  
 
-    // Add page into swap table
-    st->entries[index].hi = SET_PN(SET_PID(SET_SWAPPED(st->entries[index].hi, 0), pid), page_number);
+    // Add page into swap table, it is busy until the write is over
+    st->entries[index].hi = SET_BUSY(SET_PN(SET_SWAPPED(st->entries[index].hi, 0), page_number), 1);
+    st->entries[index].owner = pid;
+#if !LIST_ST
+    if(new_chunk)
+        chunk_add(st, index, pid);
+#endif
 
-    
-    int result = VOP_WRITE(st->fp, &swap_uio);
-    if(result)     
-        panic("VM_SWAP_OUT: Failed");
-    if(invalidate)
-        TLB_Invalidate(paddr);
+#if ZSWAP
+    if(!swap_cache_store(st, index, paddr))
+#endif
+        swap_io(st, index, &paddr, NULL, 1, UIO_WRITE);
+    st->entries[index].hi = SET_BUSY(st->entries[index].hi, 0);
+    wchan_wakeall(vm_wchan, &vm_lock);
 }
 
-void swapin(swap_table st, uint32_t index, paddr_t paddr){
-    int result;
-    struct uio swap_uio;
-    struct iovec iov;
+void swapout_cluster(swap_table st, uint32_t index, paddr_t *paddrs, uint32_t *page_numbers, uint32_t n, uint32_t pid){
+    bool to_disk[SWAPOUT_CLUSTER];
+    uint32_t i;
 
-    uio_kinit(&iov, &swap_uio, (void*)PADDR_TO_KVADDR(paddr & PAGE_FRAME), PAGE_SIZE, index*PAGE_SIZE, UIO_READ);
+    KASSERT(n >= 1 && n <= SWAPOUT_CLUSTER);
+    for(i = 0; i < n; i++){
+#if LIST_ST
+        delete_free_chunk(st, index + i);
+        insert_into_process_chunk_list(st, index + i, proc_search_pid(pid));
+#endif
+        st->entries[index + i].hi = SET_BUSY(SET_PN(SET_SWAPPED(st->entries[index + i].hi, 0), page_numbers[i]), 1);
+        st->entries[index + i].owner = pid;
+#if !LIST_ST
+        chunk_add(st, index + i, pid);
+#endif
+    }
+    //the pages that don't fit in the swap cache go to the disk, the consecutive ones with a single request
+    for(i = 0; i < n; i++){
+#if ZSWAP
+        to_disk[i] = !swap_cache_store(st, index + i, paddrs[i]);
+#else
+        to_disk[i] = true;
+#endif
+    }
+    swap_io(st, index, paddrs, to_disk, n, UIO_WRITE);
+    for(i = 0; i < n; i++){
+        st->entries[index + i].hi = SET_BUSY(st->entries[index + i].hi, 0);
+    }
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
 
-    // Remove page from swap table
-    st->entries[index].hi = SET_SWAPPED(st->entries[index].hi, 1);
-   
-    result=VOP_READ(st->fp, &swap_uio);
-    if(result) 
-        panic("VM: SWAPIN Failed");
+void swapin(swap_table st, uint32_t index, paddr_t *paddrs, uint32_t n){
+    bool from_disk[SWAP_IO_MAX];
+    uint32_t i;
 
-#if LIST_ST
-    //manage the free chunk list (add a free chunk)
-    delete_process_chunk(st, index);
-    insert_into_free_chunk_list(st, index);
+    KASSERT(n >= 1 && n <= SWAP_IO_MAX);
+    // The chunks stay owned by the pages: as long as a page is clean it is a valid copy,
+    // so evicting it again does not need any write. It is released when the process exits.
+    // A shared page may still be on its way to the chunk, or a page of the swap cache on its way back to the disk
+    do{
+        for(i = 0; i < n && !IS_BUSY(st->entries[index + i].hi); i++);
+        if(i < n)
+            wchan_sleep(vm_wchan, &vm_lock);
+    }while(i < n);
+    //one disk request for the pages of the cluster that are not in the swap cache, the frames don't need to be contiguous
+    for(i = 0; i < n; i++){
+#if ZSWAP
+        from_disk[i] = !zswap_load(st->cache, index + i, (void*)PADDR_TO_KVADDR(paddrs[i] & PAGE_FRAME));
+#else
+        from_disk[i] = true;
 #endif
+    }
+    swap_io(st, index, paddrs, from_disk, n, UIO_READ);
+}
+
+bool chunk_holds_page(swap_table st, uint32_t index, vaddr_t vaddr, pid_t pid){
+    if(index >= st->size || IS_SWAPPED(st->entries[index].hi) || IS_BUSY(st->entries[index].hi))
+        return false;
+    return GET_PN(st->entries[index].hi) == vaddr >> 12 && st->entries[index].owner == pid;
 }
 
 int getFirstFreeChunckIndex(swap_table st){
@@ -198,100 +387,54 @@ int getFirstFreeChunckIndex(swap_table st){
         return st->first_free_chunk;
     
 #else
-    for(uint32_t i = 0; i < st->size; i++){
-        if(IS_SWAPPED(st->entries[i].hi))
-            return i;
-    }
-    
+    unsigned index;
+
+    //the chunk is taken right away, it is indexed when the page is written into it
+    if(bitmap_alloc(st->free_map, &index) == 0)
+        return index;
 #endif
     return -1;
     
 }
  
 
-void elf_to_swap(swap_table st, struct vnode *v, off_t offset, uint32_t init_page_n, size_t memsize, size_t filesize, pid_t PID){
-    char buffer[PAGE_SIZE / 2];
-    static char zero_page[PAGE_SIZE];
-    int chunk_index, chunk_offset = -1;
-    uint32_t n_full_chunks = filesize / PAGE_SIZE, i, j, incr = PAGE_SIZE / 2;
-    uint32_t last_chunk_size = (filesize % PAGE_SIZE); // Could be 0 if the size in memory is a multiple of the page size
-    uint32_t n_empty_chunks = 0;
-
-    if(memsize - filesize > 0) {
-        if(last_chunk_size + (memsize - filesize) <= PAGE_SIZE) {
-            n_empty_chunks = 0;
-        } else {
-            n_empty_chunks = (memsize - filesize - 1 + last_chunk_size)/PAGE_SIZE;
-        }
-    }
+int getFreeChunkRun(swap_table st, uint32_t n){
+    uint32_t i, index, len;
+#if !LIST_ST
+    uint32_t j;
+#endif
 
-    for(i = 0; i < n_full_chunks; i++, init_page_n++){
-        // Get first chunck available
-        chunk_index = getFirstFreeChunckIndex(st);
-        if(chunk_index == -1){
-            // Handle full swapfile
-            panic("Out of swap space\n");
-        }else{
-            chunk_offset = chunk_index * PAGE_SIZE;
-            for(j = 0; j < 2; j++, chunk_offset += incr, offset += incr){
-                elf_to_swap_transfer(st, v, buffer, incr, incr, offset, chunk_offset, false);
-            }
+    //first fit from the end of the last run, so that the clusters written one after the other follow each other
+    for(i = 0, len = 0; i < st->size; i++){
+        index = (st->run_rotor + i) % st->size;
+        //runs don't wrap around the end of the swap file
+        if(index == 0)
+            len = 0;
 #if LIST_ST
-            // Add page into swap table
-            delete_free_chunk(st,chunk_index);
-            insert_into_process_chunk_list(st, chunk_index, curthread->t_proc);
+        if(!IS_SWAPPED(st->entries[index].hi)){
+#else
+        if(bitmap_isset(st->free_map, index)){
 #endif
-            st->entries[chunk_index].hi = SET_SWAPPED(SET_PID(SET_PN(st->entries[chunk_index].hi, init_page_n), PID), 0);
+            len = 0;
+            continue;
         }
-    }
-    if(last_chunk_size != 0) {
-        chunk_index = getFirstFreeChunckIndex(st);
-        if(chunk_index == -1){
-            // Handle full swapfile
-            panic("Out of swap space\n");
-        } else {
-            chunk_offset = chunk_index * PAGE_SIZE;
-            if(last_chunk_size > incr) {
-                elf_to_swap_transfer(st, v, buffer, incr, incr, offset, chunk_offset, false);
-                offset += incr;
-                chunk_offset += incr; 
-                last_chunk_size -= incr;
-                elf_to_swap_transfer(st, v, buffer, last_chunk_size, incr, offset, chunk_offset, true);
-            } else {
-                /* I need to zero-fill a portion of the page which is bigger than half-a-page */
-                /* Here I'm writing the first portion of the page, completing the first half with zeros */
-                elf_to_swap_transfer(st, v, buffer, last_chunk_size, incr, offset, chunk_offset, true);
-                /* Then, of course, I need to zero-fill also the second portion of the page */
-                chunk_offset += incr;
-                write_page(st, buffer, incr, chunk_offset, true);
+        if(++len == n){
+            st->run_rotor = (index + 1) % st->size;
+#if !LIST_ST
+            for(j = index + 1 - n; j <= index; j++){
+                bitmap_mark(st->free_map, j);
             }
-            st->entries[chunk_index].hi = SET_SWAPPED(SET_PID(SET_PN(st->entries[chunk_index].hi, init_page_n++), PID), 0);
-            add_SWAP_chunk(SWAP_0_FILLED);
-        }
-    }
-    for(i = 0; i < n_empty_chunks; i++, init_page_n++){
-        // Get first chunck available
-        chunk_index = getFirstFreeChunckIndex(st);
-        if(chunk_index == -1){
-            // Handle full swapfile
-            panic("Out of swap space\n");
-        }
-        chunk_offset = chunk_index * PAGE_SIZE;
-        write_page(st, zero_page, PAGE_SIZE, chunk_offset, false);
-#if LIST_ST
-        // Add page into swap table
-        delete_free_chunk(st,chunk_index);
-        insert_into_process_chunk_list(st, chunk_index, curthread->t_proc);
 #endif
-        st->entries[chunk_index].hi = SET_SWAPPED(SET_PID(SET_PN(st->entries[chunk_index].hi, init_page_n), PID), 0);
-        add_SWAP_chunk(SWAP_BLANK);
+            return index + 1 - n;
+        }
     }
-    return;
+    return -1;
 }
 
 int getSwapChunk(swap_table st, vaddr_t faultaddress, pid_t pid){
-    uint32_t page_n = faultaddress >> 12, i;
+    uint32_t page_n = faultaddress >> 12;
 #if LIST_ST
+    uint32_t i;
     (void)pid;
     for(i = curthread->t_proc->start_st_i; ; i = st->entries[i].next){
         if(GET_PN(st->entries[i].hi) == page_n)
@@ -300,66 +443,164 @@ int getSwapChunk(swap_table st, vaddr_t faultaddress, pid_t pid){
             break;
     }
 #else
-    for(i = 0; i < st->size; i++){
-        if(GET_PN(st->entries[i].hi) == page_n && GET_PID(st->entries[i].hi) == (uint32_t)pid && !IS_SWAPPED(st->entries[i].hi))
-            return i;
+    int chunk;
+    for(chunk = st->hash_anchor[HASH_ST(st, pid, page_n)]; chunk != -1; chunk = st->entries[chunk].hash_next){
+        if(GET_PN(st->entries[chunk].hi) == page_n && st->entries[chunk].owner == pid)
+            return chunk;
     }
 #endif
     return -1;
 }
 
+//True if one of the chunks of the current process is being written
+static bool proc_chunks_busy(swap_table st){
+#if LIST_ST
+    for(uint32_t i = 0; i < st->size; i++){
+        if(st->entries[i].owner == (uint32_t)curthread->t_proc->p_pid && !IS_SWAPPED(st->entries[i].hi) &&
+            IS_BUSY(st->entries[i].hi))
+            return true;
+    }
+#else
+    for(int i = curthread->t_proc->start_chunk_i; i != -1; i = st->entries[i].proc_next){
+        if(IS_BUSY(st->entries[i].hi))
+            return true;
+    }
+#endif
+    return false;
+}
+
 void all_proc_chunk_out(swap_table st){
+    //another thread may be saving a page we shared, the chunk can't be given away under its write
+    while(proc_chunks_busy(st))
+        wchan_sleep(vm_wchan, &vm_lock);
+#if LIST_ST
     for(uint32_t i = 0; i < st->size; i++){
-        if(GET_PID(st->entries[i].hi) == (uint32_t)curthread->t_proc->p_pid){
+        if(st->entries[i].owner == (uint32_t)curthread->t_proc->p_pid){
             st->entries[i].hi = SET_SWAPPED(st->entries[i].hi, 1);
-#if LIST_ST
             delete_process_chunk(st, i);
             insert_into_free_chunk_list(st, i);
+#if ZSWAP
+            zswap_drop(st->cache, i);
 #endif
         }
     }
+#else
+    int i, next;
+    for(i = curthread->t_proc->start_chunk_i; i != -1; i = next){
+        next = st->entries[i].proc_next;
+        chunk_free(st, i);
+        st->entries[i].proc_next = -1;
+    }
+    curthread->t_proc->start_chunk_i = -1;
+#endif
+}
 
+void chunks_release(swap_table st, vaddr_t start, vaddr_t end){
+    while(proc_chunks_busy(st))
+        wchan_sleep(vm_wchan, &vm_lock);
+#if LIST_ST
+    for(uint32_t i = 0; i < st->size; i++){
+        if(st->entries[i].owner == (uint32_t)curthread->t_proc->p_pid && !IS_SWAPPED(st->entries[i].hi) &&
+            GET_PN(st->entries[i].hi) >= start >> 12 && GET_PN(st->entries[i].hi) < end >> 12){
+            st->entries[i].hi = SET_SWAPPED(st->entries[i].hi, 1);
+            delete_process_chunk(st, i);
+            insert_into_free_chunk_list(st, i);
+#if ZSWAP
+            zswap_drop(st->cache, i);
+#endif
+        }
+    }
+#else
+    int i, next, *link = &curthread->t_proc->start_chunk_i;
+    for(i = *link; i != -1; i = next){
+        next = st->entries[i].proc_next;
+        if(GET_PN(st->entries[i].hi) < start >> 12 || GET_PN(st->entries[i].hi) >= end >> 12){
+            link = &st->entries[i].proc_next;
+            continue;
+        }
+        *link = next;
+        chunk_free(st, i);
+        st->entries[i].proc_next = -1;
+    }
+#endif
 }
 
-void chunks_fork(swap_table st, pid_t src_pid, pid_t dst_pid){
-    uint32_t i, j;
+//Give the child its own copy of the chunk i of the parent
+static void chunk_copy(swap_table st, uint32_t i, pid_t dst_pid){
     int free_chunk, result;
-    char buffer[PAGE_SIZE / 2];
     struct uio swap_uio;
     struct iovec iov;
 #if LIST_ST
     struct proc *p;
 #endif
-    uint32_t incr = PAGE_SIZE / 2, offset_src, offset_dst;
-    for(i = 0; i < st->size; i++){
-        if(GET_PID(st->entries[i].hi) == (uint32_t)src_pid && !IS_SWAPPED(st->entries[i].hi)){
-            free_chunk = getFirstFreeChunckIndex(st);
-            if(free_chunk == -1)
-                panic("Out of swap space\n");
-            offset_src = i * PAGE_SIZE;
-            offset_dst = free_chunk * PAGE_SIZE;
-            for(j = 0; j < 2; j++, offset_src += incr, offset_dst += incr){
-                //Reading from parent process chunk
-                uio_kinit(&iov, &swap_uio, buffer, incr, offset_src, UIO_READ);
-                result = VOP_READ(st->fp, &swap_uio);
-                if(result) 
-                    panic("Failed forking chunks!\n");
-                
-                //Writing new chunk for child process
-                uio_kinit(&iov, &swap_uio, buffer, incr, offset_dst, UIO_WRITE);
-                result = VOP_WRITE(st->fp, &swap_uio);
-                if(result) 
-                    panic("Failed forking chunks!\n");
-            }
+
+    //the page of the parent may be on its way to the disk
+    while(IS_BUSY(st->entries[i].hi))
+        wchan_sleep(vm_wchan, &vm_lock);
+    free_chunk = getFirstFreeChunckIndex(st);
+    if(free_chunk == -1)
+        panic("Out of swap space\n");
+    //the chunk is taken before vm_lock is released for the copy
 #if LIST_ST
-            delete_free_chunk(st, free_chunk);
-            p = proc_search_pid(dst_pid);
-            if(p != NULL)
-                insert_into_process_chunk_list(st, free_chunk, p);
+    delete_free_chunk(st, free_chunk);
+    p = proc_search_pid(dst_pid);
+    if(p != NULL)
+        insert_into_process_chunk_list(st, free_chunk, p);
 #endif
-            st->entries[free_chunk].hi = SET_PN(SET_PID(SET_SWAPPED(st->entries[free_chunk].hi, 0), dst_pid), GET_PN(st->entries[i].hi));
+    st->entries[free_chunk].hi = SET_BUSY(SET_PN(SET_SWAPPED(st->entries[free_chunk].hi, 0), GET_PN(st->entries[i].hi)), 1);
+    st->entries[free_chunk].owner = dst_pid;
+#if !LIST_ST
+    chunk_add(st, free_chunk, dst_pid);
+#endif
+#if ZSWAP
+    if(zswap_has(st->cache, i)){
+        if(zswap_dup(st->cache, i, free_chunk)){
+            st->entries[free_chunk].hi = SET_BUSY(st->entries[free_chunk].hi, 0);
+            wchan_wakeall(vm_wchan, &vm_lock);
+            return;
+        }
+        //no room for the copy in the swap cache: the page of the parent goes to the disk, where it is copied
+        while(zswap_has(st->cache, i)){
+            if(!swap_cache_writeback(st, i))
+                wchan_sleep(vm_wchan, &vm_lock);
         }
     }
+#endif
+    //a single buffer for the whole page, another fork may be copying through it
+    while(st->copy_busy)
+        wchan_sleep(vm_wchan, &vm_lock);
+    st->copy_busy = true;
+    spinlock_release(&vm_lock);
+    uio_kinit(&iov, &swap_uio, st->copy_page, PAGE_SIZE, i * PAGE_SIZE, UIO_READ);
+    result = VOP_READ(st->fp, &swap_uio);
+    if(result)
+        panic("Failed forking chunks!\n");
+    uio_kinit(&iov, &swap_uio, st->copy_page, PAGE_SIZE, free_chunk * PAGE_SIZE, UIO_WRITE);
+    result = VOP_WRITE(st->fp, &swap_uio);
+    if(result)
+        panic("Failed forking chunks!\n");
+    spinlock_acquire(&vm_lock);
+    st->copy_busy = false;
+    st->entries[free_chunk].hi = SET_BUSY(st->entries[free_chunk].hi, 0);
+    wchan_wakeall(vm_wchan, &vm_lock);
+}
+
+void chunks_fork(swap_table st, pid_t src_pid, pid_t dst_pid){
+#if LIST_ST
+    uint32_t i;
+    for(i = 0; i < st->size; i++){
+        if(st->entries[i].owner != (uint32_t)src_pid || IS_SWAPPED(st->entries[i].hi))
+            continue;
+#else
+    int i;
+    //only the chunks of the parent are visited, the child ones are added to its own list
+    for(i = proc_search_pid(src_pid)->start_chunk_i; i != -1; i = st->entries[i].proc_next){
+#endif
+        //resident pages are shared by pages_fork, their chunk may be stale
+        if(getFrameAddress(IPT, GET_PN(st->entries[i].hi), true) != -1)
+            continue;
+        chunk_copy(st, i, dst_pid);
+    }
 }
 
 void print_chunks(swap_table st){
@@ -382,11 +623,11 @@ void checkDuplicatedEntries(swap_table st){
     uint32_t i, j, first_pn, first_pid, second_pn, second_pid;
     for(i = 0; i < st->size; i++){
         first_pn = GET_PN(st->entries[i].hi);
-        first_pid = GET_PID(st->entries[i].hi);
+        first_pid = st->entries[i].owner;
         for(j = 0; j < st->size; j++){
             if(i != j){
                 second_pn = GET_PN(st->entries[j].hi);
-                second_pid = GET_PID(st->entries[j].hi);
+                second_pid = st->entries[j].owner;
                 if(first_pn == second_pn && first_pid == second_pid){
                     kprintf("\nDuplicated entries!\nFirst at %d: 0x%x\nSecond at %d: 0x%x\n", i, st->entries[i].hi, j, st->entries[j].hi);
                     return;
@@ -4,57 +4,194 @@
 #include <proc.h>
 #include <current.h>
 #include <vmstats.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <vm.h>
 
-pid_t prev_pid = -1;
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_next = 0;          /*Next ASID to be handed out in the current generation*/
+static uint32_t asid_generation = 1;    /*Incremented at every ASID rollover, 0 means no ASID assigned yet*/
+static uint32_t cpu_asid_generation[VM_MAXCPUS];   /*Generation of the ASIDs in the TLB of each CPU, 0 before the first one*/
+static uint32_t cur_asid[VM_MAXCPUS];   /*ASID currently loaded in entryhi, per CPU*/
 
-int TLB_Insert(vaddr_t faultaddress, paddr_t paddr){
+static struct tlbshootdown ts_pending[VM_MAXCPUS];  /*Batch being filled for each CPU, protected by vm_lock*/
+static unsigned ts_sent[VM_MAXCPUS];                /*Batches sent to each CPU, protected by vm_lock*/
+static volatile unsigned ts_done[VM_MAXCPUS];       /*Batches handled by each CPU, written only by that CPU*/
+
+//Software copy of the TLB of each CPU, so that finding a free slot or the slots caching a frame needs no tlb_read.
+//Only its own CPU touches it, with interrupts off. Every write to the TLB goes through slot_set and slot_clear
+#define TLB_FRAME_BUCKETS 32        /*Buckets of the map from frames to the slots caching them*/
+#define TLB_RECENT_REFILLS (NUM_TLB / 2)    /*A slot written during the last this many refills is not a victim*/
+
+struct tlb_shadow{
+	bool ready;                     /*False until the TLB is flushed for the first time, as the shadow can't tell what is there*/
+	uint32_t hi[NUM_TLB], lo[NUM_TLB];
+	uint32_t free[NUM_TLB / 32];    /*Bitmap of the invalid slots*/
+	int bucket[TLB_FRAME_BUCKETS];      /*First slot caching a frame of each bucket, -1 if none*/
+	int next[NUM_TLB];              /*Next slot in the bucket of the frame*/
+	uint32_t stamp[NUM_TLB];        /*Refill count when the slot was written*/
+	uint32_t refills;
+	unsigned hand;                  /*Next slot looked at for a victim*/
+};
+
+static struct tlb_shadow tlb_shadow[VM_MAXCPUS];
+
+#define FRAME_BUCKET(lo) ((((lo) & TLBLO_PPAGE) >> 12) % TLB_FRAME_BUCKETS)
+
+//Index of the lowest bit set in x, x != 0
+static unsigned lowest_bit(uint32_t x){
+	static const uint8_t debruijn[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	};
+	return debruijn[((x & -x) * 0x077CB531U) >> 27];
+}
+
+static void shadow_reset(struct tlb_shadow *sh){
+	unsigned i;
+
+	for(i = 0; i < NUM_TLB; i++){
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		sh->hi[i] = TLBHI_INVALID(i);
+		sh->lo[i] = TLBLO_INVALID();
+		sh->stamp[i] = sh->refills - TLB_RECENT_REFILLS;
+	}
+	for(i = 0; i < NUM_TLB / 32; i++){
+		sh->free[i] = 0xffffffff;
+	}
+	for(i = 0; i < TLB_FRAME_BUCKETS; i++){
+		sh->bucket[i] = -1;
+	}
+	sh->ready = true;
+}
+
+//Shadow of the current CPU, interrupts off
+static struct tlb_shadow *shadow_get(void){
+	struct tlb_shadow *sh = &tlb_shadow[curcpu->c_number];
+
+	if(!sh->ready)
+		shadow_reset(sh);
+	return sh;
+}
+
+static void slot_unlink(struct tlb_shadow *sh, unsigned i){
+	int *link;
+
+	for(link = &sh->bucket[FRAME_BUCKET(sh->lo[i])]; *link != (int)i; link = &sh->next[*link]){
+		KASSERT(*link != -1);
+	}
+	*link = sh->next[i];
+}
+
+static void slot_clear(struct tlb_shadow *sh, unsigned i){
+	if(!(sh->lo[i] & TLBLO_VALID))
+		return;
+	slot_unlink(sh, i);
+	tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	sh->hi[i] = TLBHI_INVALID(i);
+	sh->lo[i] = TLBLO_INVALID();
+	sh->free[i / 32] |= 1U << (i % 32);
+}
+
+static void slot_set(struct tlb_shadow *sh, unsigned i, uint32_t hi, uint32_t lo){
+	uint32_t bucket = FRAME_BUCKET(lo);
+
+	if(sh->lo[i] & TLBLO_VALID)
+		slot_unlink(sh, i);
+	tlb_write(hi, lo, i);
+	sh->hi[i] = hi;
+	sh->lo[i] = lo;
+	sh->free[i / 32] &= ~(1U << (i % 32));
+	sh->next[i] = sh->bucket[bucket];
+	sh->bucket[bucket] = i;
+	sh->stamp[i] = sh->refills++;
+}
+
+//First invalid slot, -1 if the TLB is full
+static int slot_free(struct tlb_shadow *sh){
+	unsigned w;
+
+	for(w = 0; w < NUM_TLB / 32; w++){
+		if(sh->free[w] != 0)
+			return w * 32 + lowest_bit(sh->free[w]);
+	}
+	return -1;
+}
+
+//Round robin over the slots, skipping the ones written by the last refills: a translation just loaded is the most
+//likely to be used again, and evicting it would cost another fault right away. There are always NUM_TLB - TLB_RECENT_REFILLS
+//slots older than that
+static unsigned slot_victim(struct tlb_shadow *sh){
+	unsigned i;
+
+	for(;;){
+		i = sh->hand;
+		sh->hand = (sh->hand + 1) % NUM_TLB;
+		if(sh->refills - sh->stamp[i] > TLB_RECENT_REFILLS)
+			return i;
+	}
+}
+
+int TLB_Insert(vaddr_t faultaddress, paddr_t paddr, bool writable){
 	uint32_t hi,lo;
 	int i;
+	struct tlb_shadow *sh;
 	//disable interrupt
+	int spl = splhigh();
 
-	int is_code_seg= is_code_segment(faultaddress);
-
-	//scan the tlb in order to find a free entry (invalid)
-	for(i=0;i<NUM_TLB;i++){
-		tlb_read(&hi,&lo,i);
-		if(!(lo & TLBLO_VALID)){
-			//free entry found
-			hi=faultaddress;
-			//if it's a code segment we set it as read_only
-			if(is_code_seg==1){
-				lo=paddr | TLBLO_VALID;
-			}else{
-				lo=paddr | TLBLO_DIRTY | TLBLO_VALID;
-			}
-			/* statistics */ add_TLB_fault_type(TLB_FREE);
-			tlb_write(hi,lo,i);
-			//enable interrupt
-			return 0;
-		}
+	sh = shadow_get();
+	hi=faultaddress | (cur_asid[curcpu->c_number] << TLBHI_PID_SHIFT);
+	//pages are mapped read-only until they are written, so that we know which ones are dirty
+	if(writable){
+		lo=paddr | TLBLO_DIRTY | TLBLO_VALID;
+	}else{
+		lo=paddr | TLBLO_VALID;
 	}
 
-	//if we are here we need to use a replacement algorithm (TLB full)
-	//choose the victim
-	int victim=tlb_get_rr_victim();
-	/* statistics */ add_TLB_fault_type(TLB_REPLACE);
-	//write in the tlb at index = victim
-	hi=faultaddress;
-	if(is_code_seg==1){
-		lo=paddr | TLBLO_VALID;
-	}else
-		lo=paddr | TLBLO_DIRTY | TLBLO_VALID;
+	//a read-only translation may be already there, waiting to be upgraded (to a copy of the frame, if it was shared)
+	i = tlb_probe(hi, 0);
+	if(i >= 0){
+		slot_set(sh, i, hi, lo);
+		splx(spl);
+		return 0;
+	}
 
-	tlb_write(hi,lo,victim);
+	i = slot_free(sh);
+	if(i >= 0){
+		/* statistics */ add_TLB_fault_type(TLB_FREE);
+	}else{
+		//TLB full
+		i = slot_victim(sh);
+		/* statistics */ add_TLB_fault_type(TLB_REPLACE);
+	}
+	slot_set(sh, i, hi, lo);
+	splx(spl);
 
     return 0;
 }
 
-int tlb_get_rr_victim(void) {
-	int victim;
-	static unsigned int next_victim = 0;
-	victim = next_victim;
-	next_victim = (next_victim + 1) % NUM_TLB;
-	return victim;
+bool TLB_Preload(vaddr_t vaddr, paddr_t paddr, bool writable){
+	uint32_t hi, lo;
+	int i;
+	struct tlb_shadow *sh;
+	int spl = splhigh();
+
+	sh = shadow_get();
+	hi = vaddr | (cur_asid[curcpu->c_number] << TLBHI_PID_SHIFT);
+	lo = writable ? paddr | TLBLO_DIRTY | TLBLO_VALID : paddr | TLBLO_VALID;
+	i = slot_free(sh);
+	if(i < 0 || tlb_probe(hi, 0) >= 0){
+		splx(spl);
+		return false;
+	}
+	slot_set(sh, i, hi, lo);
+	//not a refill: until it is used, the translation is a victim like the old ones
+	sh->refills--;
+	sh->stamp[i] = sh->refills - TLB_RECENT_REFILLS - 1;
+	splx(spl);
+	return true;
 }
 
 int is_code_segment(vaddr_t vaddr){
@@ -74,31 +211,170 @@ int is_code_segment(vaddr_t vaddr){
 }
 
 int TLB_Invalidate_all(void){ 
-	// Code to invalidate here
-	int i;
-	/* Avoiding calls to this function at every thread-switch */
-	if(curproc->p_pid != prev_pid) {
-		/* statistics */ add_TLB_invalidation();
-		for (i=0; i<NUM_TLB; i++) {
-			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	int spl = splhigh();
+	/* statistics */ add_TLB_invalidation();
+	shadow_reset(&tlb_shadow[curcpu->c_number]);
+	tlb_setasid(cur_asid[curcpu->c_number]);
+	splx(spl);
+    return 0;
+}
+
+int TLB_Activate(struct addrspace *as){
+	bool flushed = false;
+	unsigned me;
+	uint32_t generation;
+	int spl = splhigh();
+
+	me = curcpu->c_number;
+	spinlock_acquire(&asid_lock);
+	if(as->as_asid_gen != asid_generation){
+		//the address space has no ASID in this generation, get a new one
+		if(asid_next == NUM_ASID){
+			//all the ASIDs have been handed out: start a new generation
+			/* statistics */ add_ASID_rollover();
+			asid_generation++;
+			asid_next = 0;
 		}
+		as->as_asid = asid_next++;
+		as->as_asid_gen = asid_generation;
 	}
-	prev_pid = curproc->p_pid;
-    return 0;
+	generation = asid_generation;
+	spinlock_release(&asid_lock);
+
+	//the TLB may still hold translations of the old owners of the ASIDs:
+	//every CPU flushes its own TLB the first time it sees the new generation
+	if(cpu_asid_generation[me] != 0 && cpu_asid_generation[me] != generation){
+		TLB_Invalidate_all();
+		flushed = true;
+	}
+	cpu_asid_generation[me] = generation;
+	if(!flushed && as->as_asid != cur_asid[me]){
+		/* statistics */ add_TLB_flush_avoided();
+	}
+	cur_asid[me] = as->as_asid;
+	tlb_setasid(cur_asid[me]);
+	splx(spl);
+	return 0;
 }
 
 int TLB_Invalidate(paddr_t paddr){
     
-	int i;
-	uint32_t hi,lo,frame_number;
+	int i, next;
+	uint32_t frame_number;
+	struct tlb_shadow *sh;
+	int spl = splhigh();
+
+	sh = shadow_get();
 	//retrieve the frame number (physical address without offset)
 	frame_number=paddr & TLBLO_PPAGE;
-	for(i=0;i<NUM_TLB;i++){
-		tlb_read(&hi,&lo,i);
-		if(frame_number== (lo & TLBLO_PPAGE)){
-			tlb_write(TLBHI_INVALID(i),TLBLO_INVALID(),i);
-		}
+	//the frame may be cached with any ASID, not just the current one
+	for(i = sh->bucket[FRAME_BUCKET(frame_number)]; i != -1; i = next){
+		next = sh->next[i];
+		if(frame_number == (sh->lo[i] & TLBLO_PPAGE))
+			slot_clear(sh, i);
 	}
+	tlb_setasid(cur_asid[curcpu->c_number]);
+	splx(spl);
 
     return 0;
+}
+
+int TLB_Invalidate_range(vaddr_t start, vaddr_t end){
+	unsigned i, asid;
+	vaddr_t vaddr;
+	struct tlb_shadow *sh;
+	int spl = splhigh();
+
+	sh = shadow_get();
+	asid = cur_asid[curcpu->c_number];
+	for(i = 0; i < NUM_TLB; i++){
+		vaddr = sh->hi[i] & TLBHI_VPAGE;
+		if((sh->lo[i] & TLBLO_VALID) && ((sh->hi[i] & TLBHI_PID) >> TLBHI_PID_SHIFT) == asid && vaddr >= start && vaddr < end)
+			slot_clear(sh, i);
+	}
+	tlb_setasid(asid);
+	splx(spl);
+	return 0;
+}
+
+static void tlbshootdown_send(unsigned c){
+	struct tlbshootdown *ts = &ts_pending[c];
+
+	if(ts->ts_npages == 0)
+		return;
+	ts->ts_nbatches = 1;
+	ipi_tlbshootdown(cpu_bynumber(c), ts);
+	/* statistics */ add_TLB_shootdown_sent(ts->ts_npages);
+	ts_sent[c]++;
+	ts->ts_npages = 0;
+}
+
+void TLB_Shootdown(paddr_t paddr, uint32_t cpus){
+	struct tlbshootdown *ts;
+	unsigned c;
+
+	KASSERT(spinlock_do_i_hold(&vm_lock));
+	for(c = 0; cpus != 0; c++, cpus >>= 1){
+		if(!(cpus & 1))
+			continue;
+		ts = &ts_pending[c];
+		ts->ts_paddrs[ts->ts_npages++] = paddr & PAGE_FRAME;
+		if(ts->ts_npages == TLBSHOOTDOWN_MAX)
+			tlbshootdown_send(c);
+	}
+}
+
+void TLB_Shootdown_sync(void){
+	unsigned want[VM_MAXCPUS], c;
+	bool wait = false;
+
+	KASSERT(spinlock_do_i_hold(&vm_lock));
+	for(c = 0; c < VM_MAXCPUS; c++){
+		tlbshootdown_send(c);
+		want[c] = ts_sent[c];
+		if(ts_done[c] != want[c])
+			wait = true;
+	}
+	if(!wait)
+		return;
+	//the other CPUs may be spinning on vm_lock with interrupts off, waiting for it
+	spinlock_release(&vm_lock);
+	for(c = 0; c < VM_MAXCPUS; c++){
+		while((int)(want[c] - ts_done[c]) > 0);
+	}
+	membar_any_any();
+	spinlock_acquire(&vm_lock);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	unsigned i, me = curcpu->c_number;
+
+	if(ts->ts_npages == TLBSHOOTDOWN_ALL){
+		TLB_Invalidate_all();
+	}else{
+		for(i = 0; i < ts->ts_npages; i++){
+			TLB_Invalidate(ts->ts_paddrs[i]);
+		}
+	}
+	/* statistics */ add_TLB_shootdown_received(ts->ts_nbatches);
+	membar_any_any();
+	ts_done[me] += ts->ts_nbatches;
+}
+
+void
+vm_tlbshootdown_merge(struct tlbshootdown *into, const struct tlbshootdown *ts)
+{
+	unsigned i;
+
+	if(into->ts_npages != TLBSHOOTDOWN_ALL && ts->ts_npages != TLBSHOOTDOWN_ALL &&
+		into->ts_npages + ts->ts_npages <= TLBSHOOTDOWN_MAX){
+		for(i = 0; i < ts->ts_npages; i++){
+			into->ts_paddrs[into->ts_npages++] = ts->ts_paddrs[i];
+		}
+	}else{
+		into->ts_npages = TLBSHOOTDOWN_ALL;
+	}
+	into->ts_nbatches += ts->ts_nbatches;
 }
\ No newline at end of file
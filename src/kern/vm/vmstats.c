@@ -1,5 +1,9 @@
 #include <vmstats.h>
 #include <spinlock.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
 
 
 #define SASSERT(x) ((x) ? (void)0 : statassert(#x, __FILE__, __LINE__,  __func__))
@@ -18,10 +22,44 @@ struct statistics {
     uint32_t    tlb_faults_total,
                 tlb_faults[2],      // Free or Replace
                 tlb_invalidations,  
+                asid_rollovers,
+                tlb_flushes_avoided,
                 tlb_reloads, 
+                tlb_preloads,
+                tlb_preloads_used,
+                tlb_preloads_wasted,
+                shootdowns_sent[VM_MAXCPUS],        // Batches, per CPU
+                shootdown_pages[VM_MAXCPUS],        // Frames in the batches sent
+                shootdowns_received[VM_MAXCPUS],
                 page_faults[4],     // Zeroed, Disk, Elf, Swapfile
+                busy_waits,
+                readahead_pages,
+                readahead_hits,
+                readahead_misses,
+                ws_local_evictions,
+                ws_suspensions,
+                ws_resumes,
                 swap_writes,
-                swap_chunks[2];     // Zero-filled, Blank Chunks
+                swap_clean_evictions,
+                swap_clusters,
+                swap_clustered_pages,
+                zswap_stores,
+                zswap_same_filled,
+                zswap_rejects,
+                zswap_hits,
+                zswap_writebacks,
+                cow_shares,
+                text_shares,
+                text_saved,         // Frames not taken thanks to the shared text pages, now and at most
+                text_saved_peak,
+                mmap_shares,
+                mmap_writebacks,
+                cow_copies,
+                pageout_wakeups,
+                pageout_cleaned,
+                pageout_freed;
+    uint64_t    zswap_bytes;        // Compressed size of the pages stored in the swap cache
+    struct timespec start;              // Time of the bootstrap, to get fault throughputs
     struct spinlock lock;
 } stat;
 
@@ -32,12 +70,49 @@ stat_bootstrap(void) {
     stat.tlb_faults[0] = 0;
     stat.tlb_faults[1] = 0;
     stat.tlb_invalidations = 0;
+    stat.asid_rollovers = 0;
+    stat.tlb_flushes_avoided = 0;
     stat.tlb_reloads = 0;
+    stat.tlb_preloads = 0;
+    stat.tlb_preloads_used = 0;
+    stat.tlb_preloads_wasted = 0;
+    for(unsigned c = 0; c < VM_MAXCPUS; c++){
+        stat.shootdowns_sent[c] = 0;
+        stat.shootdown_pages[c] = 0;
+        stat.shootdowns_received[c] = 0;
+    }
     stat.page_faults[0] = 0; 
     stat.page_faults[1] = 0;
     stat.page_faults[2] = 0;
     stat.page_faults[3] = 0;
+    stat.busy_waits = 0;
+    stat.readahead_pages = 0;
+    stat.readahead_hits = 0;
+    stat.readahead_misses = 0;
+    stat.ws_local_evictions = 0;
+    stat.ws_suspensions = 0;
+    stat.ws_resumes = 0;
     stat.swap_writes = 0;
+    stat.swap_clean_evictions = 0;
+    stat.swap_clusters = 0;
+    stat.swap_clustered_pages = 0;
+    stat.zswap_stores = 0;
+    stat.zswap_same_filled = 0;
+    stat.zswap_rejects = 0;
+    stat.zswap_hits = 0;
+    stat.zswap_writebacks = 0;
+    stat.zswap_bytes = 0;
+    stat.cow_shares = 0;
+    stat.text_shares = 0;
+    stat.text_saved = 0;
+    stat.text_saved_peak = 0;
+    stat.mmap_shares = 0;
+    stat.mmap_writebacks = 0;
+    stat.cow_copies = 0;
+    stat.pageout_wakeups = 0;
+    stat.pageout_cleaned = 0;
+    stat.pageout_freed = 0;
+    gettime(&stat.start);
 }
 
 void
@@ -61,6 +136,56 @@ add_TLB_invalidation(void) {
     spinlock_release(&stat.lock);
 }
 
+void
+add_ASID_rollover(void) {
+    spinlock_acquire(&stat.lock);
+    stat.asid_rollovers++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_flush_avoided(void) {
+    spinlock_acquire(&stat.lock);
+    stat.tlb_flushes_avoided++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_shootdown_sent(unsigned npages) {
+    spinlock_acquire(&stat.lock);
+    stat.shootdowns_sent[curcpu->c_number]++;
+    stat.shootdown_pages[curcpu->c_number] += npages;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_shootdown_received(unsigned nbatches) {
+    spinlock_acquire(&stat.lock);
+    stat.shootdowns_received[curcpu->c_number] += nbatches;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_preload(unsigned n) {
+    spinlock_acquire(&stat.lock);
+    stat.tlb_preloads += n;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_preload_used(unsigned n) {
+    spinlock_acquire(&stat.lock);
+    stat.tlb_preloads_used += n;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TLB_preload_wasted(unsigned n) {
+    spinlock_acquire(&stat.lock);
+    stat.tlb_preloads_wasted += n;
+    spinlock_release(&stat.lock);
+}
+
 void
 add_TLB_reload(void) {
     spinlock_acquire(&stat.lock);
@@ -75,6 +200,85 @@ add_VM_pageFault(int type) {
     spinlock_release(&stat.lock);
 }
 
+void
+add_VM_busy_wait(void) {
+    spinlock_acquire(&stat.lock);
+    stat.busy_waits++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_VM_readahead(unsigned npages) {
+    spinlock_acquire(&stat.lock);
+    stat.readahead_pages += npages;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_VM_readahead_hit(void) {
+    spinlock_acquire(&stat.lock);
+    stat.readahead_hits++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_VM_readahead_miss(void) {
+    spinlock_acquire(&stat.lock);
+    stat.readahead_misses++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_WS_local_eviction(void) {
+    spinlock_acquire(&stat.lock);
+    stat.ws_local_evictions++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_WS_suspension(void) {
+    spinlock_acquire(&stat.lock);
+    stat.ws_suspensions++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_WS_resume(void) {
+    spinlock_acquire(&stat.lock);
+    stat.ws_resumes++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TEXT_share(void) {
+    spinlock_acquire(&stat.lock);
+    stat.text_shares++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_TEXT_saved(int delta) {
+    spinlock_acquire(&stat.lock);
+    stat.text_saved += delta;
+    if(stat.text_saved > stat.text_saved_peak)
+        stat.text_saved_peak = stat.text_saved;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_MMAP_share(void) {
+    spinlock_acquire(&stat.lock);
+    stat.mmap_shares++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_MMAP_writeback(void) {
+    spinlock_acquire(&stat.lock);
+    stat.mmap_writebacks++;
+    spinlock_release(&stat.lock);
+}
+
 void
 add_SWAP_write(void) {
     spinlock_acquire(&stat.lock);
@@ -82,16 +286,95 @@ add_SWAP_write(void) {
     spinlock_release(&stat.lock);
 }
 
-void 
-add_SWAP_chunk(int type) {
+void
+add_SWAP_cluster(unsigned npages) {
     spinlock_acquire(&stat.lock);
-    stat.swap_chunks[type]++;
+    stat.swap_clusters++;
+    stat.swap_clustered_pages += npages;
     spinlock_release(&stat.lock);
 }
 
+void
+add_ZSWAP_store(unsigned len) {
+    spinlock_acquire(&stat.lock);
+    stat.zswap_stores++;
+    if(len == 0)
+        stat.zswap_same_filled++;
+    stat.zswap_bytes += len;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_ZSWAP_reject(void) {
+    spinlock_acquire(&stat.lock);
+    stat.zswap_rejects++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_ZSWAP_hit(void) {
+    spinlock_acquire(&stat.lock);
+    stat.zswap_hits++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_ZSWAP_writeback(void) {
+    spinlock_acquire(&stat.lock);
+    stat.zswap_writebacks++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_SWAP_clean_eviction(void) {
+    spinlock_acquire(&stat.lock);
+    stat.swap_clean_evictions++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_COW_share(void) {
+    spinlock_acquire(&stat.lock);
+    stat.cow_shares++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_COW_copy(void) {
+    spinlock_acquire(&stat.lock);
+    stat.cow_copies++;
+    spinlock_release(&stat.lock);
+}
+
+
+
+void
+add_PAGEOUT_wakeup(void) {
+    spinlock_acquire(&stat.lock);
+    stat.pageout_wakeups++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_PAGEOUT_clean(void) {
+    spinlock_acquire(&stat.lock);
+    stat.pageout_cleaned++;
+    spinlock_release(&stat.lock);
+}
+
+void
+add_PAGEOUT_free(void) {
+    spinlock_acquire(&stat.lock);
+    stat.pageout_freed++;
+    spinlock_release(&stat.lock);
+}
 
 void
 print_stats(void) {
+    struct timespec now, uptime;
+
+    gettime(&now);
+    timespec_sub(&now, &stat.start, &uptime);
     /* Check possible inequalities (a.k.a. buggy behaviors) */
     spinlock_acquire(&stat.lock);
 #if VERBOSE
@@ -103,14 +386,46 @@ print_stats(void) {
     kprintf("[vm] TLB Faults - Total: %5d, Free: %5d, Replaced: %5d\n", 
                                 stat.tlb_faults_total, stat.tlb_faults[TLB_FREE], stat.tlb_faults[TLB_REPLACE]);
     kprintf("[vm] TLB Invalidations - Total: %5d\n", stat.tlb_invalidations);
+    kprintf("[vm] ASID - Rollovers: %5d, Avoided flushes: %5d\n", stat.asid_rollovers, stat.tlb_flushes_avoided);
     kprintf("[vm] TLB Reloads - Total: %5d\n", stat.tlb_reloads);
+#if FAULTAROUND_MAX_WINDOW > 0
+    kprintf("[vm] Fault-around - Preloads: %5d, Used: %5d, Wasted: %5d\n",
+                                stat.tlb_preloads, stat.tlb_preloads_used, stat.tlb_preloads_wasted);
+#endif
+    for(unsigned c = 0; c < VM_MAXCPUS; c++){
+        if(stat.shootdowns_sent[c] == 0 && stat.shootdowns_received[c] == 0)
+            continue;
+        kprintf("[vm] TLB Shootdowns cpu%u - Sent: %5d, Pages: %5d, Received: %5d\n", c,
+                                stat.shootdowns_sent[c], stat.shootdown_pages[c], stat.shootdowns_received[c]);
+    }
     uint32_t total_page_faults = stat.page_faults[VM_ZEROED] + stat.page_faults[VM_DISK] +
                                 stat.page_faults[VM_ELF] + stat.page_faults[VM_SWAP];
     kprintf("[vm] Page Faults - Total: %5d, Zeroed: %5d, Disk: %5d, ELF: %5d, Swapfile: %5d\n", 
                                 total_page_faults, stat.page_faults[VM_ZEROED], 
                                 stat.page_faults[VM_DISK], stat.page_faults[VM_ELF], stat.page_faults[VM_SWAP]); 
-    kprintf("[vm] Swapfile Writes - Total: %5d\n", stat.swap_writes);
-    kprintf("[vm] Swapfile Chunks - Zero-filled: %5d, Blank: %5d\n", stat.swap_chunks[SWAP_0_FILLED], stat.swap_chunks[SWAP_BLANK]);
+    kprintf("[vm] Pages in transit - Waits: %5d\n", stat.busy_waits);
+    kprintf("[vm] Read-ahead - Pages: %5d, Hits: %5d, Misses: %5d\n", stat.readahead_pages, stat.readahead_hits, stat.readahead_misses);
+    kprintf("[vm] Working sets - Local evictions: %5d, Suspensions: %5d, Resumes: %5d\n",
+                                stat.ws_local_evictions, stat.ws_suspensions, stat.ws_resumes);
+    kprintf("[vm] Swapfile Writes - Total: %5d, Clean evictions avoided: %5d, Clusters: %5d, Clustered pages: %5d\n",
+                                stat.swap_writes, stat.swap_clean_evictions, stat.swap_clusters, stat.swap_clustered_pages);
+#if ZSWAP
+    //ratio of the size of the compressed pages stored to their compressed size, in percent: 300 means 3:1
+    uint32_t compressed = stat.zswap_stores - stat.zswap_same_filled;
+    kprintf("[vm] Swap cache - Stores: %5d, Same-filled: %5d, Rejected: %5d, Hits: %5d, Disk writebacks: %5d, Compression percent: %5lu\n",
+                                stat.zswap_stores, stat.zswap_same_filled, stat.zswap_rejects, stat.zswap_hits, stat.zswap_writebacks,
+                                stat.zswap_bytes == 0 ? 0UL : (unsigned long)((uint64_t)compressed * PAGE_SIZE * 100 / stat.zswap_bytes));
+#endif
+    kprintf("[vm] Copy-on-write - Shared pages: %5d, Copies: %5d\n", stat.cow_shares, stat.cow_copies);
+    kprintf("[vm] Shared text - Mappings: %5d, Frames saved: %5d, Peak frames saved: %5d, Peak bytes saved: %5d\n",
+                                stat.text_shares, stat.text_saved, stat.text_saved_peak, stat.text_saved_peak * PAGE_SIZE);
+    kprintf("[vm] Mapped files - Shared pages: %5d, Writebacks: %5d\n", stat.mmap_shares, stat.mmap_writebacks);
+#if PAGEOUT_DAEMON
+    kprintf("[vm] Pageout daemon - Low watermark: %5d, High watermark: %5d, Wakeups: %5d, Pages cleaned: %5d, Frames freed: %5d\n",
+                                PAGEOUT_LOW_WATERMARK, PAGEOUT_HIGH_WATERMARK,
+                                stat.pageout_wakeups, stat.pageout_cleaned, stat.pageout_freed);
+#endif
+    kprintf("[vm] Uptime - Milliseconds: %5lu\n", (unsigned long)(uptime.tv_sec * 1000 + uptime.tv_nsec / 1000000));
     spinlock_release(&stat.lock);
 }   
 
@@ -0,0 +1,317 @@
+#include "zswap.h"
+#include <lib.h>
+#include <vm.h>
+#include <bitmap.h>
+#include <vmstats.h>
+
+//The pool is handed out in units, a compressed page takes a run of them
+#define ZSWAP_UNIT 256
+//A page is kept only if it compresses to 3/4 of its size at least
+#define ZSWAP_MAX_COMPRESSED (PAGE_SIZE / 4 * 3)
+
+//LZ77 with an LZ4-like format: every sequence is a token (4 bits of literal length, 4 bits of match length - MIN_MATCH),
+//the literal length extension, the literals, the offset on 2 bytes and the match length extension.
+//The last sequence has literals only. Lengths of 15 or more continue in the next bytes, 255 meaning there is one more
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
+
+struct zentry{
+    bool present;
+    uint32_t len;               /*Compressed size in bytes, 0 for a page filled with the same word*/
+    uint32_t fill;              /*Word the page is filled with, if len == 0*/
+    uint32_t first_unit;        /*First unit of the compressed page*/
+    int lru_prev, lru_next;     /*Pages taking room in the pool, from the most recently used one*/
+};
+
+struct zswap{
+    struct zentry *entries;
+    uint32_t n_chunks;
+    char *pool;
+    struct bitmap *units;       /*Units in use*/
+    uint32_t n_units;
+    uint32_t rotor;             /*Where the search for free units starts*/
+    int lru_head, lru_tail;
+    uint16_t hash[1 << LZ_HASH_BITS];               /*Last position of each hash of 4 bytes, compressor only*/
+    uint8_t scratch[ZSWAP_MAX_COMPRESSED];          /*Output of the compressor*/
+};
+
+static uint32_t read32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t hash4(const uint8_t *p){
+    return (read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+//Write the extension of a length field, NULL if it does not fit before oend
+static uint8_t *lz_putlen(uint8_t *op, uint8_t *oend, uint32_t len){
+    for(; len >= 255; len -= 255){
+        if(op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if(op >= oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+//Write the literals from anchor to ip, preceded by their token, NULL if they do not fit before oend
+static uint8_t *lz_putliterals(uint8_t *op, uint8_t *oend, const uint8_t *anchor, const uint8_t *ip, uint8_t **token){
+    uint32_t lit = ip - anchor;
+
+    if(op >= oend)
+        return NULL;
+    *token = op++;
+    **token = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15 && (op = lz_putlen(op, oend, lit - 15)) == NULL)
+        return NULL;
+    if(op + lit > oend)
+        return NULL;
+    memcpy(op, anchor, lit);
+    return op + lit;
+}
+
+//Compress a page into out, return the compressed size or 0 if it is bigger than max
+static uint32_t lz_compress(zswap_pool z, const uint8_t *in, uint8_t *out, uint32_t max){
+    const uint8_t *ip = in, *anchor = in, *ref, *iend = in + PAGE_SIZE;
+    uint8_t *op = out, *oend = out + max, *token;
+    uint32_t h, mlen, off;
+
+    bzero(z->hash, sizeof(z->hash));
+    while(ip + LZ_MIN_MATCH <= iend){
+        h = hash4(ip);
+        ref = in + z->hash[h];
+        z->hash[h] = ip - in;
+        if(ref >= ip || read32(ref) != read32(ip)){
+            ip++;
+            continue;
+        }
+        for(mlen = LZ_MIN_MATCH; ip + mlen < iend && ref[mlen] == ip[mlen]; mlen++);
+        if((op = lz_putliterals(op, oend, anchor, ip, &token)) == NULL || op + 2 > oend)
+            return 0;
+        *token |= mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15;
+        off = ip - ref;
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if(mlen - LZ_MIN_MATCH >= 15 && (op = lz_putlen(op, oend, mlen - LZ_MIN_MATCH - 15)) == NULL)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if((op = lz_putliterals(op, oend, anchor, iend, &token)) == NULL)
+        return 0;
+    return op - out;
+}
+
+static void lz_decompress(const uint8_t *ip, uint8_t *out){
+    uint8_t *op = out, *oend = out + PAGE_SIZE;
+    const uint8_t *ref;
+    uint32_t token, len;
+
+    for(;;){
+        token = *ip++;
+        len = token >> 4;
+        if(len == 15){
+            do{
+                len += *ip;
+            }while(*ip++ == 255);
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if(op >= oend)
+            break;
+        ref = op - (ip[0] | (ip[1] << 8));
+        ip += 2;
+        len = (token & 15) + LZ_MIN_MATCH;
+        if((token & 15) == 15){
+            do{
+                len += *ip;
+            }while(*ip++ == 255);
+        }
+        //the match may overlap the output, byte by byte
+        while(len-- > 0)
+            *op++ = *ref++;
+    }
+    KASSERT(op == oend);
+}
+
+static void lru_remove(zswap_pool z, uint32_t index){
+    struct zentry *e = &z->entries[index];
+
+    if(e->lru_prev == -1)
+        z->lru_head = e->lru_next;
+    else
+        z->entries[e->lru_prev].lru_next = e->lru_next;
+    if(e->lru_next == -1)
+        z->lru_tail = e->lru_prev;
+    else
+        z->entries[e->lru_next].lru_prev = e->lru_prev;
+}
+
+static void lru_insert(zswap_pool z, uint32_t index){
+    struct zentry *e = &z->entries[index];
+
+    e->lru_prev = -1;
+    e->lru_next = z->lru_head;
+    if(z->lru_head != -1)
+        z->entries[z->lru_head].lru_prev = index;
+    else
+        z->lru_tail = index;
+    z->lru_head = index;
+}
+
+//First of n free units, marked in use, -1 if there is no such run
+static int units_alloc(zswap_pool z, uint32_t n){
+    uint32_t i, u, len, j;
+
+    for(i = 0, len = 0; i < z->n_units; i++){
+        u = (z->rotor + i) % z->n_units;
+        if(u == 0)
+            len = 0;
+        if(bitmap_isset(z->units, u)){
+            len = 0;
+            continue;
+        }
+        if(++len == n){
+            for(j = u + 1 - n; j <= u; j++){
+                bitmap_mark(z->units, j);
+            }
+            z->rotor = (u + 1) % z->n_units;
+            return u + 1 - n;
+        }
+    }
+    return -1;
+}
+
+static uint32_t units_of(uint32_t len){
+    return (len + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+}
+
+//Keep a page of len bytes compressed in z->scratch (or same-filled if len == 0), false if there is no room
+static bool entry_set(zswap_pool z, uint32_t index, uint32_t len, uint32_t fill, const void *data){
+    struct zentry *e = &z->entries[index];
+    int first = 0;
+
+    if(len > 0){
+        first = units_alloc(z, units_of(len));
+        if(first == -1)
+            return false;
+        memcpy(z->pool + first * ZSWAP_UNIT, data, len);
+        lru_insert(z, index);
+    }
+    e->present = true;
+    e->len = len;
+    e->fill = fill;
+    e->first_unit = first;
+    return true;
+}
+
+zswap_pool zswapInit(uint32_t n_chunks, uint32_t pool_pages){
+    zswap_pool z = kmalloc(sizeof(*z));
+    uint32_t i;
+
+    if(z == NULL)
+        panic("VM: Failed to create the swap cache\n");
+    z->entries = kmalloc(n_chunks * sizeof(*(z->entries)));
+    z->n_units = pool_pages * (PAGE_SIZE / ZSWAP_UNIT);
+    z->pool = kmalloc(pool_pages * PAGE_SIZE);
+    z->units = bitmap_create(z->n_units);
+    if(z->entries == NULL || z->pool == NULL || z->units == NULL)
+        panic("VM: Failed to create the swap cache\n");
+    z->n_chunks = n_chunks;
+    for(i = 0; i < n_chunks; i++){
+        z->entries[i].present = false;
+    }
+    z->rotor = 0;
+    z->lru_head = z->lru_tail = -1;
+    return z;
+}
+
+int zswap_store(zswap_pool z, uint32_t index, const void *page){
+    const uint32_t *words = page;
+    uint32_t i, len;
+
+    zswap_drop(z, index);
+    for(i = 1; i < PAGE_SIZE / sizeof(uint32_t) && words[i] == words[0]; i++);
+    if(i == PAGE_SIZE / sizeof(uint32_t)){
+        entry_set(z, index, 0, words[0], NULL);
+        /*statistics*/add_ZSWAP_store(0);
+        return ZSWAP_STORED;
+    }
+    len = lz_compress(z, page, z->scratch, ZSWAP_MAX_COMPRESSED);
+    if(len == 0 || units_of(len) > z->n_units){
+        /*statistics*/add_ZSWAP_reject();
+        return ZSWAP_REJECTED;
+    }
+    if(!entry_set(z, index, len, 0, z->scratch))
+        return z->lru_tail != -1 ? ZSWAP_FULL : ZSWAP_REJECTED;
+    /*statistics*/add_ZSWAP_store(len);
+    return ZSWAP_STORED;
+}
+
+static void entry_get(zswap_pool z, uint32_t index, void *page){
+    struct zentry *e = &z->entries[index];
+    uint32_t *words = page, i;
+
+    if(e->len == 0){
+        for(i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++){
+            words[i] = e->fill;
+        }
+        return;
+    }
+    lz_decompress((uint8_t *)z->pool + e->first_unit * ZSWAP_UNIT, page);
+}
+
+bool zswap_load(zswap_pool z, uint32_t index, void *page){
+    struct zentry *e = &z->entries[index];
+
+    if(!e->present)
+        return false;
+    entry_get(z, index, page);
+    //the copy stays: the chunk is still the copy of the page while it is clean
+    if(e->len > 0){
+        lru_remove(z, index);
+        lru_insert(z, index);
+    }
+    /*statistics*/add_ZSWAP_hit();
+    return true;
+}
+
+bool zswap_dup(zswap_pool z, uint32_t src, uint32_t dst){
+    struct zentry *e = &z->entries[src];
+
+    KASSERT(e->present);
+    zswap_drop(z, dst);
+    return entry_set(z, dst, e->len, e->fill, z->pool + e->first_unit * ZSWAP_UNIT);
+}
+
+bool zswap_has(zswap_pool z, uint32_t index){
+    return z->entries[index].present;
+}
+
+void zswap_drop(zswap_pool z, uint32_t index){
+    struct zentry *e = &z->entries[index];
+    uint32_t u;
+
+    if(!e->present)
+        return;
+    if(e->len > 0){
+        for(u = e->first_unit; u < e->first_unit + units_of(e->len); u++){
+            bitmap_unmark(z->units, u);
+        }
+        lru_remove(z, index);
+    }
+    e->present = false;
+}
+
+int zswap_oldest(zswap_pool z){
+    return z->lru_tail;
+}
+
+void zswap_evict(zswap_pool z, uint32_t index, void *page){
+    KASSERT(z->entries[index].present);
+    entry_get(z, index, page);
+    zswap_drop(z, index);
+}
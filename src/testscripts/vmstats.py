@@ -0,0 +1,151 @@
+#!/usr/pkg/bin/python2.7
+# vmstats.py - compare the paging VM statistics of several kernels
+# usage: vmstats.py [options] program...
+# options:
+#    --kernel=KERNEL	Kernel to run, may be repeated (default "kernel")
+#    --cpus=N		Number of cpus, may be repeated (default from sys161 config)
+#    --field=FIELD	Statistic to report, may be repeated
+#			(default "Page Faults Total" and "Swapfile Writes Total")
+#    --conf=sys161.conf	Use alternate sys161 config
+#    --timeout=N	Global timeout per run, in seconds (default 300)
+#
+# Every program is run on its own freshly booted kernel with "p PROGRAM;q",
+# so that the statistics printed by vm_shutdown cover that program only.
+# Statistics are named after the "[vm] Name - Key: value" lines they come
+# from, as "Name Key". A field ending in "/s" is reported per second of
+# kernel uptime, e.g. "Page Faults Total/s" for the fault throughput.
+#
+# Examples (build one kernel per configuration first, e.g. one per
+# replacement policy, RA in kern/include/vm.h):
+#    vmstats.py -k kernel-FIFO -k kernel-CLOCK \
+#	testbin/matmult testbin/sort testbin/huge
+#    vmstats.py -f "Page Faults Swapfile" -f "Read-ahead Pages" \
+#	-f "Read-ahead Hits" -f "Read-ahead Misses" testbin/huge testbin/sort
+#    vmstats.py -f "Page Faults Total" -f "Working sets Local evictions" \
+#	-f "Working sets Suspensions" testbin/triplehuge testbin/triplemat
+#    vmstats.py -f "TLB Faults Total" -f "Fault-around Preloads" \
+#	-f "Fault-around Used" -f "Fault-around Wasted" testbin/matmult
+#    vmstats.py -f "Page Faults Total" -f "Page Faults Total/s" \
+#	testbin/forkbench testbin/forkscale
+#    vmstats.py -j 1 -j 2 -j 4 -f "Page Faults Total" \
+#	-f "Page Faults Total/s" -f "Pages in transit Waits" testbin/parallelvm
+#
+# The last one is the scaling run of the fault path: with faults on
+# different pages going on in parallel, the fault throughput of parallelvm
+# should grow with the number of cpus.
+#
+
+import re
+import sys
+from optparse import OptionParser
+from StringIO import StringIO
+
+import runtest
+
+############################################################
+# global settings
+
+g_conf = None
+g_cpus = []
+g_fields = []
+g_kernels = []
+g_timeout = 300
+
+############################################################
+# parsing
+
+statline = re.compile(r"^\[vm\] ([^-]+?) - (.*)$")
+statfield = re.compile(r"([A-Za-z][A-Za-z /-]*?): *([0-9]+)")
+
+def parsestats(output):
+	stats = {}
+	for line in output.splitlines():
+		m = statline.match(line.strip())
+		if m is None:
+			continue
+		name = m.group(1).strip()
+		for (key, value) in statfield.findall(m.group(2)):
+			stats["%s %s" % (name, key.strip())] = int(value)
+	return stats
+# end parsestats
+
+def getstat(stats, field):
+	if not field.endswith("/s"):
+		return stats.get(field)
+	value = stats.get(field[:-2])
+	ms = stats.get("Uptime Milliseconds")
+	if value is None or not ms:
+		return None
+	return value * 1000 / ms
+# end getstat
+
+############################################################
+# main
+
+def getargs():
+	global g_conf
+	global g_cpus
+	global g_fields
+	global g_kernels
+	global g_timeout
+
+	p = OptionParser()
+	p.add_option("-c", "--conf", dest="conf")
+	p.add_option("-f", "--field", dest="fields", action="append")
+	p.add_option("-j", "--cpus", dest="cpus", action="append")
+	p.add_option("-k", "--kernel", dest="kernels", action="append")
+	p.add_option("-t", "--timeout", dest="timeout")
+
+	(options, args) = p.parse_args()
+	if options.conf is not None:
+		g_conf = options.conf
+	if options.cpus is not None:
+		g_cpus = [int(c) for c in options.cpus]
+	if options.fields is not None:
+		g_fields = options.fields
+	if options.kernels is not None:
+		g_kernels = options.kernels
+	if options.timeout is not None:
+		g_timeout = int(options.timeout)
+
+	if len(g_cpus) == 0:
+		g_cpus = [None]
+	if len(g_fields) == 0:
+		g_fields = ["Page Faults Total", "Swapfile Writes Total"]
+	if len(g_kernels) == 0:
+		g_kernels = ["kernel"]
+
+	if len(args) == 0:
+		sys.stderr.write("Usage: vmstats.py [options] program...\n")
+		exit(1)
+	return args
+# end getargs
+
+programs = getargs()
+print "%-20s %-5s %-20s %s" % ("kernel", "cpus", "program",
+	" ".join(["%22s" % f for f in g_fields]))
+for kernel in g_kernels:
+	for cpus in g_cpus:
+		for prog in programs:
+			output = StringIO()
+			msg = runtest.run("p %s;q" % prog,
+				output,
+				conf=g_conf,
+				cpus=cpus,
+				timeout=g_timeout,
+				kernel=kernel)
+			if msg is not None:
+				sys.stderr.write("vmstats.py: %s on %s aborted with %s\n"
+					% (prog, kernel, msg))
+				continue
+			stats = parsestats(output.getvalue())
+			values = []
+			for f in g_fields:
+				value = getstat(stats, f)
+				if value is not None:
+					values.append("%22d" % value)
+				else:
+					values.append("%22s" % "-")
+			print "%-20s %-5s %-20s %s" % (kernel, cpus, prog,
+				" ".join(values))
+exit(0)
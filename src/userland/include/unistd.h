@@ -57,6 +57,9 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     mmap:     sys/mman.h
+ *     munmap:   sys/mman.h
+ *     msync:    sys/mman.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
@@ -0,0 +1,95 @@
+/*
+ * forkbench - measure fork latency.
+ *
+ * Usage: forkbench [npages [nforks]]
+ *
+ * The parent touches NPAGES pages of a big array, so that they are
+ * resident, then forks NFORKS children one at a time. Each child
+ * checks that it sees the parent's data and exits right away; the
+ * parent waits for it before forking the next one. With copy-on-write
+ * fork the cost of a fork should not grow with the number of pages
+ * the parent has touched.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define MAXPAGES	256
+#define DEFPAGES	64
+#define DEFFORKS	16
+
+static char data[MAXPAGES * PAGE_SIZE];
+
+static
+void
+touch(unsigned npages)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		data[i * PAGE_SIZE] = (char)i;
+	}
+}
+
+static
+void
+child(unsigned npages)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		if (data[i * PAGE_SIZE] != (char)i) {
+			_exit(1);
+		}
+	}
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned npages = DEFPAGES, nforks = DEFFORKS, i;
+	time_t before_s, after_s;
+	unsigned long before_ns, after_ns;
+	unsigned long long ns;
+	int pid, status;
+
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nforks = atoi(argv[2]);
+	}
+	if (npages > MAXPAGES || nforks == 0) {
+		errx(1, "Usage: forkbench [npages (max %d) [nforks]]",
+		     MAXPAGES);
+	}
+
+	touch(npages);
+
+	__time(&before_s, &before_ns);
+	for (i=0; i<nforks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			child(npages);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+			errx(1, "child %d saw the wrong data", pid);
+		}
+	}
+	__time(&after_s, &after_ns);
+
+	ns = (after_s - before_s) * 1000000000ULL + after_ns - before_ns;
+	printf("forkbench: %u pages, %u forks: %llu us/fork\n",
+	       npages, nforks, ns / nforks / 1000);
+	return 0;
+}
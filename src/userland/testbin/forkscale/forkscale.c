@@ -0,0 +1,110 @@
+/*
+ * forkscale - run several hundred processes at once.
+ *
+ * Usage: forkscale [nprocs [npages]]
+ *
+ * The parent forks NPROCS children without waiting for any of them, so
+ * that they all live together. Each child fills NPAGES pages with a
+ * pattern made of its own pid, then checks them a few times while the
+ * others do the same and the pages get paged in and out. A child seeing
+ * a pattern other than its own means the VM confused the pages of two
+ * processes, as happened when pids were kept in 6 bits in the page and
+ * swap tables and pid 65 aliased pid 1.
+ *
+ * At the end the parent prints the time per process and per page,
+ * to compare the fault cost with the one of a few processes.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE_SIZE	4096
+#define MAXPROCS	1000
+#define MAXPAGES	64
+#define DEFPROCS	300
+#define DEFPAGES	8
+#define ROUNDS		4
+
+static int data[MAXPAGES * PAGE_SIZE / sizeof(int)];
+static pid_t pids[MAXPROCS];
+
+static
+void
+child(unsigned npages)
+{
+	unsigned i, j, r;
+	int mypid = getpid();
+
+	for (i=0; i<npages; i++) {
+		for (j=0; j<PAGE_SIZE / sizeof(int); j += 64) {
+			data[i * PAGE_SIZE / sizeof(int) + j] = mypid + i;
+		}
+	}
+	for (r=0; r<ROUNDS; r++) {
+		for (i=0; i<npages; i++) {
+			for (j=0; j<PAGE_SIZE / sizeof(int); j += 64) {
+				if (data[i * PAGE_SIZE / sizeof(int) + j]
+				    != mypid + (int)i) {
+					_exit(1);
+				}
+			}
+		}
+	}
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned nprocs = DEFPROCS, npages = DEFPAGES, i, bad = 0;
+	time_t before_s, after_s;
+	unsigned long before_ns, after_ns;
+	unsigned long long ns;
+	int status;
+
+	if (argc > 1) {
+		nprocs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		npages = atoi(argv[2]);
+	}
+	if (nprocs == 0 || nprocs > MAXPROCS ||
+	    npages == 0 || npages > MAXPAGES) {
+		errx(1, "Usage: forkscale [nprocs (max %d) [npages (max %d)]]",
+		     MAXPROCS, MAXPAGES);
+	}
+
+	__time(&before_s, &before_ns);
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork %u", i);
+		}
+		if (pids[i] == 0) {
+			child(npages);
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("process %d saw pages of another one",
+			      pids[i]);
+			bad++;
+		}
+	}
+	__time(&after_s, &after_ns);
+
+	if (bad > 0) {
+		errx(1, "%u of %u processes failed", bad, nprocs);
+	}
+	ns = (after_s - before_s) * 1000000000ULL + after_ns - before_ns;
+	printf("forkscale: %u processes, %u pages each: %llu us/process, "
+	       "%llu us/page\n", nprocs, npages, ns / nprocs / 1000,
+	       ns / (nprocs * npages) / 1000);
+	printf("forkscale: passed\n");
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest.c: file mappings.
+ *
+ * Writes a file, maps it shared and checks that the pages fault in
+ * with its contents. The changes made through the mapping, by this
+ * process and by a child sharing it across fork, must be in the file
+ * after msync and munmap. Changes to a private mapping must not, and
+ * a write through a read-only mapping must end the process. Bad
+ * protections fail with EINVAL, and a shared writable mapping of a
+ * file open read-only with EACCES.
+ *
+ * Run with little RAM, some dirty pages of the mapping are evicted
+ * and go back to the file that way as well.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+#define PAGE     4096
+#define NPAGES   64
+#define NWORDS   (NPAGES * PAGE / sizeof(unsigned))
+#define FILENAME "mmaptest.dat"
+
+static unsigned buf[PAGE / sizeof(unsigned)];
+
+/* Value of the word i of the file after the step-th round of writes */
+static
+unsigned
+pattern(unsigned i, unsigned step)
+{
+	return i * 2654435761U + step;
+}
+
+static
+void
+writefile(void)
+{
+	unsigned i, j;
+	int fd;
+
+	fd = open(FILENAME, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", FILENAME);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		for (j = 0; j < PAGE / sizeof(unsigned); j++) {
+			buf[j] = pattern(i * (PAGE / sizeof(unsigned)) + j, 0);
+		}
+		if (write(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+	close(fd);
+}
+
+/* Check the file with read(): word i must be pattern(i, step) */
+static
+void
+checkfile(unsigned step)
+{
+	unsigned i, j, k;
+	int fd;
+
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		if (read(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: read", FILENAME);
+		}
+		for (j = 0; j < PAGE / sizeof(unsigned); j++) {
+			k = i * (PAGE / sizeof(unsigned)) + j;
+			if (buf[j] != pattern(k, step)) {
+				errx(1, "%s: word %u is %u, expected %u",
+				     FILENAME, k, buf[j], pattern(k, step));
+			}
+		}
+	}
+	close(fd);
+}
+
+/* mmap must fail with the error code expected */
+static
+void
+checkfail(int fd, int prot, int flags, int expected, const char *what)
+{
+	void *map;
+
+	map = mmap(NULL, PAGE, prot, flags, fd, 0);
+	if (map != MAP_FAILED) {
+		errx(1, "mmap %s: succeeded", what);
+	}
+	if (errno != expected) {
+		err(1, "mmap %s: wrong error", what);
+	}
+}
+
+static
+void
+checkmap(unsigned *map, unsigned from, unsigned to, unsigned step)
+{
+	unsigned i;
+
+	for (i = from; i < to; i++) {
+		if (map[i] != pattern(i, step)) {
+			errx(1, "mapping: word %u is %u, expected %u",
+			     i, map[i], pattern(i, step));
+		}
+	}
+}
+
+int
+main(void)
+{
+	unsigned *map, i;
+	int fd, status;
+	pid_t pid;
+
+	writefile();
+	fd = open(FILENAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+
+	/* Shared: the pages come from the file, the changes go back to it */
+	map = mmap(NULL, NPAGES * PAGE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	checkmap(map, 0, NWORDS, 0);
+	for (i = 0; i < NWORDS / 2; i++) {
+		map[i] = pattern(i, 1);
+	}
+
+	/* The child writes the other half, in the same frames */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		checkmap(map, 0, NWORDS / 2, 1);
+		for (i = NWORDS / 2; i < NWORDS; i++) {
+			map[i] = pattern(i, 1);
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	checkmap(map, 0, NWORDS, 1);
+	if (msync(map, NPAGES * PAGE, MS_SYNC) < 0) {
+		err(1, "msync");
+	}
+	checkfile(1);
+
+	for (i = 0; i < NWORDS; i++) {
+		map[i] = pattern(i, 2);
+	}
+	if (munmap(map, NPAGES * PAGE) < 0) {
+		err(1, "munmap shared");
+	}
+	checkfile(2);
+
+	/* Private: the changes stay in the process */
+	map = mmap(NULL, NPAGES * PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+	checkmap(map, 0, NWORDS, 2);
+	for (i = 0; i < NWORDS; i++) {
+		map[i] = pattern(i, 3);
+	}
+	checkmap(map, 0, NWORDS, 3);
+	if (munmap(map, NPAGES * PAGE) < 0) {
+		err(1, "munmap private");
+	}
+	checkfile(2);
+
+	/*
+	 * Read-only: a page made dirty through a writable mapping must
+	 * not be writable through a PROT_READ mapping of it. The child
+	 * maps the file read-only next to the writable mapping it got
+	 * across fork, and its write must end it before it can _exit.
+	 */
+	map = mmap(NULL, NPAGES * PAGE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	for (i = 0; i < NWORDS; i++) {
+		map[i] = pattern(i, 4);
+	}
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		unsigned *romap;
+
+		romap = mmap(NULL, NPAGES * PAGE, PROT_READ, MAP_SHARED,
+			     fd, 0);
+		if (romap == MAP_FAILED) {
+			err(1, "mmap read-only");
+		}
+		checkmap(romap, 0, NWORDS, 4);
+		romap[0] = ~pattern(0, 4);
+		_exit(2);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		errx(1, "write through a read-only mapping was allowed");
+	}
+	checkmap(map, 0, NWORDS, 4);
+	if (munmap(map, NPAGES * PAGE) < 0) {
+		err(1, "munmap shared");
+	}
+	checkfile(4);
+
+	checkfail(fd, PROT_NONE, MAP_SHARED, EINVAL, "PROT_NONE");
+	checkfail(fd, PROT_EXEC, MAP_PRIVATE, EINVAL, "PROT_EXEC only");
+	checkfail(fd, PROT_READ | 0x100, MAP_SHARED, EINVAL, "unknown prot");
+	close(fd);
+
+	/* A private copy can be written, the file can't */
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", FILENAME);
+	}
+	checkfail(fd, PROT_READ|PROT_WRITE, MAP_SHARED, EACCES,
+		  "shared writable of a read-only file");
+	map = mmap(NULL, NPAGES * PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap private of a read-only file");
+	}
+	map[0] = ~pattern(0, 4);
+	if (munmap(map, NPAGES * PAGE) < 0) {
+		err(1, "munmap private");
+	}
+	close(fd);
+	checkfile(4);
+
+	printf("mmaptest: passed\n");
+	return 0;
+}